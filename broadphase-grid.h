@@ -0,0 +1,134 @@
+#ifndef BROADPHASE_GRID_H
+#define BROADPHASE_GRID_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "square-collide.h"
+#include "square-store.h"
+
+// Uniform grid broadphase. Cells are as big as the largest square, so
+// every square lands in at most 2x2 cells. Cells are hashed into a
+// table about twice the entry count and the entries are bucketed with a
+// counting sort into one flat array, so a rebuild is two linear passes
+// with no per-cell allocations. Only squares in the same cell are
+// tested against each other, which keeps pair finding near O(n) as long
+// as squares are spread out.
+class SpatialHashGrid
+{
+private:
+    struct Entry {
+	std::int32_t cell_x;
+	std::int32_t cell_y;
+	std::uint32_t body;
+    };
+
+    double m_cell_size {1.0};
+    double m_inv_cell_size {1.0};
+    std::size_t m_mask {0};
+    // m_bucket_start[h] .. m_bucket_start[h + 1] are bucket h's entries
+    std::vector<std::uint32_t> m_bucket_start;
+    std::vector<Entry> m_entries;
+
+    std::int32_t cell(double x) const {
+	return static_cast<std::int32_t>(std::floor(x * m_inv_cell_size));
+    }
+
+    std::size_t bucket(std::int32_t cx, std::int32_t cy) const {
+	std::uint32_t h = static_cast<std::uint32_t>(cx) * 73856093u
+	    ^ static_cast<std::uint32_t>(cy) * 19349663u;
+	return h & m_mask;
+    }
+
+    // Call fn(cx, cy) for every cell square i overlaps
+    template <typename Fn>
+    void for_cells(const SquareStore& store, std::size_t i, Fn&& fn) const {
+	const std::int32_t x0 = cell(store.pos_x[i]);
+	const std::int32_t y0 = cell(store.pos_y[i]);
+	const std::int32_t x1 = cell(store.pos_x[i] + store.size_x[i]);
+	const std::int32_t y1 = cell(store.pos_y[i] + store.size_y[i]);
+	for (std::int32_t cy = y0; cy <= y1; ++cy) {
+	    for (std::int32_t cx = x0; cx <= x1; ++cx) {
+		fn(cx, cy);
+	    }
+	}
+    }
+
+public:
+    double cellSize() const { return m_cell_size; }
+
+    void build(const SquareStore& store) {
+	const std::size_t n = store.size();
+	double largest = 1.0;
+	for (std::size_t i = 0; i < n; ++i) {
+	    largest = std::max({largest, store.size_x[i], store.size_y[i]});
+	}
+	m_cell_size = largest;
+	m_inv_cell_size = 1.0 / largest;
+
+	std::size_t table = 16;
+	while (table < n * 8) {
+	    table <<= 1;
+	}
+	m_mask = table - 1;
+
+	// Count entries per bucket
+	m_bucket_start.assign(table + 1, 0);
+	for (std::size_t i = 0; i < n; ++i) {
+	    for_cells(store, i, [this](std::int32_t cx, std::int32_t cy) {
+		++m_bucket_start[bucket(cx, cy) + 1];
+	    });
+	}
+	for (std::size_t h = 0; h < table; ++h) {
+	    m_bucket_start[h + 1] += m_bucket_start[h];
+	}
+
+	// Scatter, using the bucket starts as write cursors and shifting
+	// them back afterwards
+	m_entries.resize(m_bucket_start[table]);
+	for (std::size_t i = 0; i < n; ++i) {
+	    for_cells(store, i, [this, i](std::int32_t cx, std::int32_t cy) {
+		m_entries[m_bucket_start[bucket(cx, cy)]++] = {cx, cy, static_cast<std::uint32_t>(i)};
+	    });
+	}
+	for (std::size_t h = table; h > 0; --h) {
+	    m_bucket_start[h] = m_bucket_start[h - 1];
+	}
+	m_bucket_start[0] = 0;
+    }
+
+    // Append overlapping pairs to pairs. A pair sharing several cells is
+    // only reported from the cell holding the top-left corner of their
+    // overlap.
+    void find_pairs(const SquareStore& store, std::vector<CollisionPair>& pairs) const {
+	const std::size_t table = m_mask + 1;
+	for (std::size_t h = 0; h < table; ++h) {
+	    const std::uint32_t begin = m_bucket_start[h];
+	    const std::uint32_t end = m_bucket_start[h + 1];
+	    for (std::uint32_t e = begin; e < end; ++e) {
+		const Entry& first = m_entries[e];
+		for (std::uint32_t f = e + 1; f < end; ++f) {
+		    const Entry& second = m_entries[f];
+		    if (first.cell_x != second.cell_x || first.cell_y != second.cell_y) {
+			continue;
+		    }
+		    const std::uint32_t a = std::min(first.body, second.body);
+		    const std::uint32_t b = std::max(first.body, second.body);
+		    if (!squares_overlap(store, a, b)) {
+			continue;
+		    }
+		    const double corner_x = std::max(store.pos_x[a], store.pos_x[b]);
+		    const double corner_y = std::max(store.pos_y[a], store.pos_y[b]);
+		    if (cell(corner_x) == first.cell_x && cell(corner_y) == first.cell_y) {
+			pairs.push_back({a, b});
+		    }
+		}
+	    }
+	}
+    }
+};
+
+#endif // BROADPHASE_GRID_H
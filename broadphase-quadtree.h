@@ -0,0 +1,291 @@
+#ifndef BROADPHASE_QUADTREE_H
+#define BROADPHASE_QUADTREE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "broadphase-tree.h"
+#include "square-collide.h"
+#include "square-store.h"
+
+// Loose region quadtree. Every node covers a square region; its loose
+// bounds are twice as big, so a square belongs to the deepest node
+// whose region holds its center and whose half-size is at least the
+// square's half-extent. Nodes only split once they hold more than
+// kSplitCount squares, so the tree grows deep where squares pile up
+// (on the floor) and stays shallow where the screen is empty, which is
+// what a uniform grid can't do.
+//
+// A square only moves node when it leaves its node's loose bounds, and
+// then it is unlinked and reinserted in place. Squares are kept in
+// per-node intrusive lists and nodes come from a pool in groups of
+// four, so steady-state updates don't allocate.
+class LooseQuadtree
+{
+private:
+    static constexpr int kNull {-1};
+    static constexpr int kSplitCount {8};
+    static constexpr int kMaxDepth {12};
+
+    struct Node {
+	double center_x {0.0};
+	double center_y {0.0};
+	double half {0.0};
+	int parent {kNull};
+	// Children are four consecutive nodes, or kNull for a leaf
+	int first_child {kNull};
+	int first_body {kNull};
+	int count {0};
+	int depth {0};
+
+	bool leaf() const { return first_child == kNull; }
+	Aabb loose() const {
+	    return {center_x - 2.0 * half, center_y - 2.0 * half,
+		    center_x + 2.0 * half, center_y + 2.0 * half};
+	}
+    };
+
+    std::vector<Node> m_nodes;
+    // Free groups of four child nodes, by first index
+    std::vector<int> m_free_groups;
+    std::vector<int> m_body_node;
+    std::vector<int> m_body_next;
+    std::vector<int> m_body_prev;
+    std::size_t m_bodies {0};
+    std::uint32_t m_generation {0};
+    double m_world_x {0.0};
+    double m_world_y {0.0};
+    double m_world_size {1.0};
+    mutable std::vector<int> m_stack;
+
+    static double center_x(const SquareStore& store, std::size_t i) {
+	return store.pos_x[i] + store.size_x[i] * 0.5;
+    }
+    static double center_y(const SquareStore& store, std::size_t i) {
+	return store.pos_y[i] + store.size_y[i] * 0.5;
+    }
+    static double half_extent(const SquareStore& store, std::size_t i) {
+	return std::max(store.size_x[i], store.size_y[i]) * 0.5;
+    }
+
+    void link(int node, int body) {
+	Node& n = m_nodes[node];
+	m_body_node[body] = node;
+	m_body_prev[body] = kNull;
+	m_body_next[body] = n.first_body;
+	if (n.first_body != kNull) {
+	    m_body_prev[n.first_body] = body;
+	}
+	n.first_body = body;
+	++n.count;
+    }
+
+    void unlink(int body) {
+	Node& n = m_nodes[m_body_node[body]];
+	const int prev = m_body_prev[body];
+	const int next = m_body_next[body];
+	if (prev != kNull) {
+	    m_body_next[prev] = next;
+	} else {
+	    n.first_body = next;
+	}
+	if (next != kNull) {
+	    m_body_prev[next] = prev;
+	}
+	--n.count;
+    }
+
+    // Child of node that should take body, or kNull if it is too big to
+    // go any deeper. A square can sit in a node while its center is
+    // outside the node's region, in which case even the nearest child's
+    // loose bounds may not hold it.
+    int child_for(int node, const SquareStore& store, int body) const {
+	const Node& n = m_nodes[node];
+	if (n.leaf() || half_extent(store, body) > n.half * 0.5) {
+	    return kNull;
+	}
+	int quadrant = (center_x(store, body) >= n.center_x ? 1 : 0)
+	    + (center_y(store, body) >= n.center_y ? 2 : 0);
+	int child = n.first_child + quadrant;
+	if (!m_nodes[child].loose().contains(Aabb::of_square(store, body))) {
+	    return kNull;
+	}
+	return child;
+    }
+
+    void split(int node) {
+	int first;
+	if (!m_free_groups.empty()) {
+	    first = m_free_groups.back();
+	    m_free_groups.pop_back();
+	} else {
+	    first = static_cast<int>(m_nodes.size());
+	    m_nodes.resize(m_nodes.size() + 4);
+	}
+	const Node parent = m_nodes[node];
+	const double quarter = parent.half * 0.5;
+	for (int q = 0; q < 4; ++q) {
+	    Node& child = m_nodes[first + q];
+	    child = Node {};
+	    child.center_x = parent.center_x + ((q & 1) ? quarter : -quarter);
+	    child.center_y = parent.center_y + ((q & 2) ? quarter : -quarter);
+	    child.half = quarter;
+	    child.parent = node;
+	    child.depth = parent.depth + 1;
+	}
+	m_nodes[node].first_child = first;
+    }
+
+    void push_down(int node, const SquareStore& store) {
+	int body = m_nodes[node].first_body;
+	while (body != kNull) {
+	    const int next = m_body_next[body];
+	    const int child = child_for(node, store, body);
+	    if (child != kNull) {
+		unlink(body);
+		link(child, body);
+	    }
+	    body = next;
+	}
+    }
+
+    void insert(int body, const SquareStore& store) {
+	// Squares outside the root region entirely stay at the root
+	int node = 0;
+	for (;;) {
+	    Node& n = m_nodes[node];
+	    if (n.leaf() && n.count >= kSplitCount && n.depth < kMaxDepth) {
+		split(node);
+		push_down(node, store);
+	    }
+	    const int child = child_for(node, store, body);
+	    if (child == kNull) {
+		link(node, body);
+		return;
+	    }
+	    node = child;
+	}
+    }
+
+    // Fold a node's children back in once they are all empty leaves
+    void collapse(int node) {
+	while (node != kNull) {
+	    Node& n = m_nodes[node];
+	    if (n.leaf()) {
+		node = n.parent;
+		continue;
+	    }
+	    for (int q = 0; q < 4; ++q) {
+		const Node& child = m_nodes[n.first_child + q];
+		if (!child.leaf() || child.count > 0) {
+		    return;
+		}
+	    }
+	    m_free_groups.push_back(n.first_child);
+	    n.first_child = kNull;
+	    node = n.parent;
+	}
+    }
+
+    void rebuild(const SquareStore& store) {
+	m_bodies = store.size();
+	m_generation = store.generation;
+	m_body_node.assign(m_bodies, kNull);
+	m_body_next.assign(m_bodies, kNull);
+	m_body_prev.assign(m_bodies, kNull);
+	m_free_groups.clear();
+	m_nodes.clear();
+	Node root;
+	root.center_x = m_world_x + m_world_size * 0.5;
+	root.center_y = m_world_y + m_world_size * 0.5;
+	root.half = m_world_size * 0.5;
+	m_nodes.push_back(root);
+	for (std::size_t i = 0; i < m_bodies; ++i) {
+	    insert(static_cast<int>(i), store);
+	}
+    }
+
+public:
+    LooseQuadtree() = default;
+    LooseQuadtree(double x, double y, double width, double height) {
+	setWorld(x, y, width, height);
+    }
+
+    // Region the root node covers; squares outside it still work, they
+    // just all sit in the root
+    void setWorld(double x, double y, double width, double height) {
+	m_world_x = x;
+	m_world_y = y;
+	m_world_size = std::max(width, height);
+	m_bodies = 0;
+    }
+
+    std::size_t nodeCount() const { return m_nodes.size() - m_free_groups.size() * 4; }
+
+    // Move squares that left their node's loose bounds. Rebuilds from
+    // scratch when squares were added or the store was reinitialized.
+    void update(const SquareStore& store) {
+	if (store.size() != m_bodies || store.generation != m_generation || m_nodes.empty()) {
+	    rebuild(store);
+	    return;
+	}
+	for (std::size_t i = 0; i < m_bodies; ++i) {
+	    const int body = static_cast<int>(i);
+	    const int node = m_body_node[body];
+	    const Node& n = m_nodes[node];
+	    // Still inside its node's loose bounds (anything goes at the
+	    // root) and can't drop any deeper
+	    const bool inside = node == 0 || n.loose().contains(Aabb::of_square(store, body));
+	    const bool deepest = n.leaf() || child_for(node, store, body) == kNull;
+	    if (inside && deepest) {
+		continue;
+	    }
+	    unlink(body);
+	    collapse(node);
+	    insert(body, store);
+	}
+    }
+
+    // Call fn(body) for every square that may overlap box
+    template <typename Fn>
+    void query(const Aabb& box, Fn&& fn) const {
+	if (m_nodes.empty()) {
+	    return;
+	}
+	m_stack.clear();
+	m_stack.push_back(0);
+	while (!m_stack.empty()) {
+	    const int node = m_stack.back();
+	    m_stack.pop_back();
+	    const Node& n = m_nodes[node];
+	    // The root also holds squares outside its loose bounds
+	    if (node != 0 && !n.loose().overlaps(box)) {
+		continue;
+	    }
+	    for (int body = n.first_body; body != kNull; body = m_body_next[body]) {
+		fn(static_cast<std::uint32_t>(body));
+	    }
+	    if (!n.leaf()) {
+		for (int q = 0; q < 4; ++q) {
+		    m_stack.push_back(n.first_child + q);
+		}
+	    }
+	}
+    }
+
+    // Append overlapping square pairs to pairs
+    void find_pairs(const SquareStore& store, std::vector<CollisionPair>& pairs) const {
+	for (std::size_t i = 0; i < m_bodies; ++i) {
+	    const std::uint32_t a = static_cast<std::uint32_t>(i);
+	    query(Aabb::of_square(store, i), [&](std::uint32_t b) {
+		if (b > a && squares_overlap(store, a, b)) {
+		    pairs.push_back({a, b});
+		}
+	    });
+	}
+    }
+};
+
+#endif // BROADPHASE_QUADTREE_H
@@ -0,0 +1,114 @@
+#ifndef BROADPHASE_SAP_H
+#define BROADPHASE_SAP_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "square-collide.h"
+#include "square-store.h"
+
+// Sweep-and-prune broadphase along x. Unlike the grid it doesn't care
+// how much square sizes vary. The sorted endpoint array is kept between
+// steps, and squares only move a little per step, so re-sorting it
+// with an insertion sort is close to linear. A full sort only happens
+// when squares are added or the store is reinitialized.
+class SweepAndPrune
+{
+private:
+    static constexpr std::uint32_t kMaxFlag {0x80000000u};
+
+    struct Endpoint {
+	double value;
+	// Body index, with kMaxFlag set for the right edge
+	std::uint32_t body;
+
+	bool is_max() const { return body & kMaxFlag; }
+	std::uint32_t index() const { return body & ~kMaxFlag; }
+    };
+
+    // At equal x, right edges sort first so squares that only touch are
+    // never active together. A zero-width square still opens before it
+    // closes.
+    static bool before(const Endpoint& a, const Endpoint& b) {
+	if (a.value != b.value) {
+	    return a.value < b.value;
+	}
+	if (a.index() == b.index()) {
+	    return !a.is_max() && b.is_max();
+	}
+	return a.is_max() && !b.is_max();
+    }
+
+    std::vector<Endpoint> m_endpoints;
+    std::vector<std::uint32_t> m_active;
+    // Where each body sits in m_active while it is active
+    std::vector<std::uint32_t> m_active_slot;
+    std::size_t m_bodies {0};
+    std::uint32_t m_generation {0};
+
+    void rebuild(const SquareStore& store) {
+	m_bodies = store.size();
+	m_generation = store.generation;
+	m_endpoints.clear();
+	for (std::size_t i = 0; i < m_bodies; ++i) {
+	    std::uint32_t body = static_cast<std::uint32_t>(i);
+	    m_endpoints.push_back({store.pos_x[i], body});
+	    m_endpoints.push_back({store.pos_x[i] + store.size_x[i], body | kMaxFlag});
+	}
+	std::sort(m_endpoints.begin(), m_endpoints.end(), before);
+	m_active_slot.resize(m_bodies);
+    }
+
+public:
+    // Bring the endpoint array up to date with the store
+    void update(const SquareStore& store) {
+	if (store.size() != m_bodies || store.generation != m_generation) {
+	    rebuild(store);
+	    return;
+	}
+	const double* px = store.pos_x.data();
+	const double* sx = store.size_x.data();
+	for (Endpoint& e : m_endpoints) {
+	    const std::uint32_t i = e.index();
+	    e.value = e.is_max() ? px[i] + sx[i] : px[i];
+	}
+	for (std::size_t i = 1; i < m_endpoints.size(); ++i) {
+	    const Endpoint e = m_endpoints[i];
+	    std::size_t j = i;
+	    while (j > 0 && before(e, m_endpoints[j - 1])) {
+		m_endpoints[j] = m_endpoints[j - 1];
+		--j;
+	    }
+	    m_endpoints[j] = e;
+	}
+    }
+
+    // Sweep left to right, testing each square that starts against the
+    // ones still open, and append overlapping pairs
+    void find_pairs(const SquareStore& store, std::vector<CollisionPair>& pairs) {
+	m_active.clear();
+	for (const Endpoint& e : m_endpoints) {
+	    const std::uint32_t i = e.index();
+	    if (e.is_max()) {
+		// Swap-remove from the active list
+		const std::uint32_t slot = m_active_slot[i];
+		const std::uint32_t last = m_active.back();
+		m_active[slot] = last;
+		m_active_slot[last] = slot;
+		m_active.pop_back();
+		continue;
+	    }
+	    for (std::uint32_t j : m_active) {
+		if (squares_overlap(store, i, j)) {
+		    pairs.push_back({std::min(i, j), std::max(i, j)});
+		}
+	    }
+	    m_active_slot[i] = static_cast<std::uint32_t>(m_active.size());
+	    m_active.push_back(i);
+	}
+    }
+};
+
+#endif // BROADPHASE_SAP_H
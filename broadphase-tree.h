@@ -0,0 +1,439 @@
+#ifndef BROADPHASE_TREE_H
+#define BROADPHASE_TREE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "square-collide.h"
+#include "square-store.h"
+
+struct Aabb {
+    double min_x {0.0};
+    double min_y {0.0};
+    double max_x {0.0};
+    double max_y {0.0};
+
+    static Aabb of_square(const SquareStore& store, std::size_t i) {
+	return {store.pos_x[i], store.pos_y[i],
+		store.pos_x[i] + store.size_x[i], store.pos_y[i] + store.size_y[i]};
+    }
+    static Aabb merge(const Aabb& a, const Aabb& b) {
+	return {std::min(a.min_x, b.min_x), std::min(a.min_y, b.min_y),
+		std::max(a.max_x, b.max_x), std::max(a.max_y, b.max_y)};
+    }
+    bool overlaps(const Aabb& o) const {
+	return min_x <= o.max_x && o.min_x <= max_x
+	    && min_y <= o.max_y && o.min_y <= max_y;
+    }
+    bool contains(const Aabb& o) const {
+	return min_x <= o.min_x && min_y <= o.min_y
+	    && o.max_x <= max_x && o.max_y <= max_y;
+    }
+    bool contains(double x, double y) const {
+	return min_x <= x && x < max_x && min_y <= y && y < max_y;
+    }
+    double perimeter() const {
+	return 2.0 * ((max_x - min_x) + (max_y - min_y));
+    }
+
+    // Fraction along the segment from (x0, y0) by (dx, dy) where it
+    // enters the box, or a negative number if it misses within max_t
+    double ray_entry(double x0, double y0, double dx, double dy, double max_t) const {
+	double t_min = 0.0;
+	double t_max = max_t;
+	const double origin[2] = {x0, y0};
+	const double dir[2] = {dx, dy};
+	const double lo[2] = {min_x, min_y};
+	const double hi[2] = {max_x, max_y};
+	for (int axis = 0; axis < 2; ++axis) {
+	    if (dir[axis] == 0.0) {
+		if (origin[axis] < lo[axis] || origin[axis] > hi[axis]) {
+		    return -1.0;
+		}
+		continue;
+	    }
+	    double t1 = (lo[axis] - origin[axis]) / dir[axis];
+	    double t2 = (hi[axis] - origin[axis]) / dir[axis];
+	    if (t1 > t2) {
+		std::swap(t1, t2);
+	    }
+	    t_min = std::max(t_min, t1);
+	    t_max = std::min(t_max, t2);
+	    if (t_min > t_max) {
+		return -1.0;
+	    }
+	}
+	return t_min;
+    }
+};
+
+// Dynamic bounding volume hierarchy over squares. Leaves hold a fat box
+// (the square grown by a margin and by where its velocity is taking
+// it), so a square only gets reinserted once it leaves its fat box.
+// Inserts pick the sibling by perimeter cost and the tree is kept
+// height-balanced with rotations. Nodes are pooled in one vector with a
+// free list.
+//
+// Besides being a broadphase it answers point, rectangle and ray
+// queries, e.g. for picking squares with the mouse.
+class DynamicAabbTree
+{
+private:
+    static constexpr int kNull {-1};
+
+    struct Node {
+	Aabb box;
+	int parent {kNull};
+	int child1 {kNull};
+	int child2 {kNull};
+	int height {0};
+	std::uint32_t body {0};
+
+	bool leaf() const { return child1 == kNull; }
+    };
+
+    std::vector<Node> m_nodes;
+    int m_root {kNull};
+    // Free nodes are chained through their parent field
+    int m_free {kNull};
+    std::vector<int> m_leaf_of_body;
+    std::size_t m_bodies {0};
+    std::uint32_t m_generation {0};
+    mutable std::vector<int> m_stack;
+
+    int allocate_node() {
+	if (m_free == kNull) {
+	    m_nodes.emplace_back();
+	    return static_cast<int>(m_nodes.size() - 1);
+	}
+	int node = m_free;
+	m_free = m_nodes[node].parent;
+	m_nodes[node] = Node {};
+	return node;
+    }
+
+    void free_node(int node) {
+	m_nodes[node].parent = m_free;
+	m_nodes[node].height = -1;
+	m_free = node;
+    }
+
+    Aabb fatten(const SquareStore& store, std::size_t i) const {
+	Aabb box = Aabb::of_square(store, i);
+	box.min_x -= margin;
+	box.min_y -= margin;
+	box.max_x += margin;
+	box.max_y += margin;
+	// Stretch the box the way the square is heading
+	const double dx = store.vel_x[i] * velocity_lookahead;
+	const double dy = store.vel_y[i] * velocity_lookahead;
+	(dx < 0 ? box.min_x : box.max_x) += dx;
+	(dy < 0 ? box.min_y : box.max_y) += dy;
+	return box;
+    }
+
+    void replace_child(int parent, int old_child, int new_child) {
+	if (parent == kNull) {
+	    m_root = new_child;
+	} else if (m_nodes[parent].child1 == old_child) {
+	    m_nodes[parent].child1 = new_child;
+	} else {
+	    m_nodes[parent].child2 = new_child;
+	}
+    }
+
+    // Refit boxes and heights from node up to the root, rebalancing on
+    // the way
+    void refit(int node) {
+	while (node != kNull) {
+	    node = balance(node);
+	    Node& n = m_nodes[node];
+	    const Node& c1 = m_nodes[n.child1];
+	    const Node& c2 = m_nodes[n.child2];
+	    n.height = 1 + std::max(c1.height, c2.height);
+	    n.box = Aabb::merge(c1.box, c2.box);
+	    node = n.parent;
+	}
+    }
+
+    void insert_leaf(int leaf) {
+	if (m_root == kNull) {
+	    m_root = leaf;
+	    m_nodes[leaf].parent = kNull;
+	    return;
+	}
+
+	// Walk down to the cheapest sibling by perimeter cost
+	const Aabb leaf_box = m_nodes[leaf].box;
+	int index = m_root;
+	while (!m_nodes[index].leaf()) {
+	    const Node& n = m_nodes[index];
+	    const double area = n.box.perimeter();
+	    const double combined = Aabb::merge(n.box, leaf_box).perimeter();
+	    // Cost of making a new parent for this node and the leaf
+	    const double cost = 2.0 * combined;
+	    // Cost every level below pays for the box growing
+	    const double inheritance = 2.0 * (combined - area);
+	    auto descend_cost = [&](int child) {
+		const Node& c = m_nodes[child];
+		const double merged = Aabb::merge(leaf_box, c.box).perimeter();
+		return (c.leaf() ? merged : merged - c.box.perimeter()) + inheritance;
+	    };
+	    const double cost1 = descend_cost(n.child1);
+	    const double cost2 = descend_cost(n.child2);
+	    if (cost < cost1 && cost < cost2) {
+		break;
+	    }
+	    index = cost1 < cost2 ? n.child1 : n.child2;
+	}
+
+	const int sibling = index;
+	const int old_parent = m_nodes[sibling].parent;
+	const int new_parent = allocate_node();
+	Node& p = m_nodes[new_parent];
+	p.parent = old_parent;
+	p.box = Aabb::merge(leaf_box, m_nodes[sibling].box);
+	p.height = m_nodes[sibling].height + 1;
+	p.child1 = sibling;
+	p.child2 = leaf;
+	replace_child(old_parent, sibling, new_parent);
+	m_nodes[sibling].parent = new_parent;
+	m_nodes[leaf].parent = new_parent;
+
+	refit(new_parent);
+    }
+
+    void remove_leaf(int leaf) {
+	if (leaf == m_root) {
+	    m_root = kNull;
+	    return;
+	}
+	const int parent = m_nodes[leaf].parent;
+	const int grandparent = m_nodes[parent].parent;
+	const int sibling = m_nodes[parent].child1 == leaf
+	    ? m_nodes[parent].child2 : m_nodes[parent].child1;
+	replace_child(grandparent, parent, sibling);
+	m_nodes[sibling].parent = grandparent;
+	free_node(parent);
+	refit(grandparent);
+    }
+
+    // Rotate a grandchild up if one side of a is more than one level
+    // taller than the other. Returns the node now in a's place.
+    int balance(int a) {
+	Node* A = &m_nodes[a];
+	if (A->leaf() || A->height < 2) {
+	    return a;
+	}
+	const int b = A->child1;
+	const int c = A->child2;
+	Node* B = &m_nodes[b];
+	Node* C = &m_nodes[c];
+	const int diff = C->height - B->height;
+
+	if (diff > 1) {
+	    // Rotate C up
+	    const int f = C->child1;
+	    const int g = C->child2;
+	    Node* F = &m_nodes[f];
+	    Node* G = &m_nodes[g];
+	    C->child1 = a;
+	    C->parent = A->parent;
+	    A->parent = c;
+	    replace_child(C->parent, a, c);
+	    if (F->height > G->height) {
+		C->child2 = f;
+		A->child2 = g;
+		G->parent = a;
+		A->box = Aabb::merge(B->box, G->box);
+		C->box = Aabb::merge(A->box, F->box);
+		A->height = 1 + std::max(B->height, G->height);
+		C->height = 1 + std::max(A->height, F->height);
+	    } else {
+		C->child2 = g;
+		A->child2 = f;
+		F->parent = a;
+		A->box = Aabb::merge(B->box, F->box);
+		C->box = Aabb::merge(A->box, G->box);
+		A->height = 1 + std::max(B->height, F->height);
+		C->height = 1 + std::max(A->height, G->height);
+	    }
+	    return c;
+	}
+
+	if (diff < -1) {
+	    // Rotate B up
+	    const int d = B->child1;
+	    const int e = B->child2;
+	    Node* D = &m_nodes[d];
+	    Node* E = &m_nodes[e];
+	    B->child1 = a;
+	    B->parent = A->parent;
+	    A->parent = b;
+	    replace_child(B->parent, a, b);
+	    if (D->height > E->height) {
+		B->child2 = d;
+		A->child1 = e;
+		E->parent = a;
+		A->box = Aabb::merge(C->box, E->box);
+		B->box = Aabb::merge(A->box, D->box);
+		A->height = 1 + std::max(C->height, E->height);
+		B->height = 1 + std::max(A->height, D->height);
+	    } else {
+		B->child2 = e;
+		A->child1 = d;
+		D->parent = a;
+		A->box = Aabb::merge(C->box, D->box);
+		B->box = Aabb::merge(A->box, E->box);
+		A->height = 1 + std::max(C->height, D->height);
+		B->height = 1 + std::max(A->height, E->height);
+	    }
+	    return b;
+	}
+	return a;
+    }
+
+    void rebuild(const SquareStore& store) {
+	m_nodes.clear();
+	m_root = kNull;
+	m_free = kNull;
+	m_bodies = store.size();
+	m_generation = store.generation;
+	m_leaf_of_body.resize(m_bodies);
+	for (std::size_t i = 0; i < m_bodies; ++i) {
+	    int leaf = allocate_node();
+	    m_nodes[leaf].box = fatten(store, i);
+	    m_nodes[leaf].body = static_cast<std::uint32_t>(i);
+	    m_leaf_of_body[i] = leaf;
+	    insert_leaf(leaf);
+	}
+    }
+
+public:
+    // How far fat boxes reach past the square, in pixels
+    double margin {4.0};
+    // How many steps of velocity fat boxes stretch ahead
+    double velocity_lookahead {2.0};
+
+    int height() const { return m_root == kNull ? 0 : m_nodes[m_root].height; }
+
+    // Reinsert squares that left their fat boxes. Rebuilds from scratch
+    // when squares were added or the store was reinitialized.
+    void update(const SquareStore& store) {
+	if (store.size() != m_bodies || store.generation != m_generation) {
+	    rebuild(store);
+	    return;
+	}
+	for (std::size_t i = 0; i < m_bodies; ++i) {
+	    const int leaf = m_leaf_of_body[i];
+	    if (m_nodes[leaf].box.contains(Aabb::of_square(store, i))) {
+		continue;
+	    }
+	    remove_leaf(leaf);
+	    m_nodes[leaf].box = fatten(store, i);
+	    insert_leaf(leaf);
+	}
+    }
+
+    // Call fn(body) for every square whose fat box overlaps box. fn
+    // returns false to stop early.
+    template <typename Fn>
+    void query(const Aabb& box, Fn&& fn) const {
+	if (m_root == kNull) {
+	    return;
+	}
+	m_stack.clear();
+	m_stack.push_back(m_root);
+	while (!m_stack.empty()) {
+	    const Node& n = m_nodes[m_stack.back()];
+	    m_stack.pop_back();
+	    if (!n.box.overlaps(box)) {
+		continue;
+	    }
+	    if (n.leaf()) {
+		if (!fn(n.body)) {
+		    return;
+		}
+	    } else {
+		m_stack.push_back(n.child1);
+		m_stack.push_back(n.child2);
+	    }
+	}
+    }
+
+    // Append every square overlapping rect to out
+    void query_rect(const SquareStore& store, const Aabb& rect, std::vector<std::uint32_t>& out) const {
+	query(rect, [&](std::uint32_t body) {
+	    const Aabb tight = Aabb::of_square(store, body);
+	    if (tight.min_x < rect.max_x && rect.min_x < tight.max_x
+		&& tight.min_y < rect.max_y && rect.min_y < tight.max_y) {
+		out.push_back(body);
+	    }
+	    return true;
+	});
+    }
+
+    // Topmost (last drawn, so highest index) square under the point, or
+    // -1
+    long pick(const SquareStore& store, double x, double y) const {
+	long best = -1;
+	query({x, y, x, y}, [&](std::uint32_t body) {
+	    if (static_cast<long>(body) > best && Aabb::of_square(store, body).contains(x, y)) {
+		best = body;
+	    }
+	    return true;
+	});
+	return best;
+    }
+
+    // First square hit by the segment from (x0, y0) to (x1, y1), or -1.
+    // t is set to the hit's fraction along the segment.
+    long raycast(const SquareStore& store, double x0, double y0, double x1, double y1, double& t) const {
+	long hit = -1;
+	t = 1.0;
+	if (m_root == kNull) {
+	    return hit;
+	}
+	const double dx = x1 - x0;
+	const double dy = y1 - y0;
+	m_stack.clear();
+	m_stack.push_back(m_root);
+	while (!m_stack.empty()) {
+	    const Node& n = m_nodes[m_stack.back()];
+	    m_stack.pop_back();
+	    if (n.box.ray_entry(x0, y0, dx, dy, t) < 0.0) {
+		continue;
+	    }
+	    if (!n.leaf()) {
+		m_stack.push_back(n.child1);
+		m_stack.push_back(n.child2);
+		continue;
+	    }
+	    // Clip the ray to the nearest exact hit so far
+	    const double entry = Aabb::of_square(store, n.body).ray_entry(x0, y0, dx, dy, t);
+	    if (entry >= 0.0 && (hit < 0 || entry < t)) {
+		t = entry;
+		hit = n.body;
+	    }
+	}
+	return hit;
+    }
+
+    // Append overlapping square pairs to pairs
+    void find_pairs(const SquareStore& store, std::vector<CollisionPair>& pairs) const {
+	for (std::size_t i = 0; i < m_bodies; ++i) {
+	    const std::uint32_t a = static_cast<std::uint32_t>(i);
+	    query(Aabb::of_square(store, i), [&](std::uint32_t b) {
+		if (b > a && squares_overlap(store, a, b)) {
+		    pairs.push_back({a, b});
+		}
+		return true;
+	    });
+	}
+    }
+};
+
+#endif // BROADPHASE_TREE_H
@@ -0,0 +1,293 @@
+#ifndef FAST_RANDOM_H
+#define FAST_RANDOM_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <random>
+
+#include "square-simd.h"
+#include "square-store.h"
+
+// Small-state random numbers for the simulation: xoshiro128** (16 bytes
+// of state, no multiplies beyond shift-and-add) per thread, plus an
+// 8-lane version of the same generator for filling arrays in bulk.
+
+inline std::uint64_t splitmix64(std::uint64_t& x)
+{
+    std::uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+inline std::uint32_t rotl32(std::uint32_t x, int k)
+{
+    return (x << k) | (x >> (32 - k));
+}
+
+class RandomGenerator
+{
+private:
+    std::uint32_t m_s[4] {1, 2, 3, 4};
+
+public:
+    // Words of state, for saving a generator and picking it up later
+    static constexpr std::size_t kStateWords {4};
+
+    RandomGenerator() = default;
+    RandomGenerator(std::uint64_t seed, std::uint64_t stream) { reseed(seed, stream); }
+
+    void getState(std::uint32_t* out) const { std::memcpy(out, m_s, sizeof(m_s)); }
+    void setState(const std::uint32_t* in) { std::memcpy(m_s, in, sizeof(m_s)); }
+
+    void reseed(std::uint64_t seed, std::uint64_t stream) {
+	std::uint64_t x = seed ^ (stream * 0xd1342543de82ef95ull);
+	std::uint64_t a = splitmix64(x);
+	std::uint64_t b = splitmix64(x);
+	m_s[0] = static_cast<std::uint32_t>(a);
+	m_s[1] = static_cast<std::uint32_t>(a >> 32);
+	m_s[2] = static_cast<std::uint32_t>(b);
+	m_s[3] = static_cast<std::uint32_t>(b >> 32);
+    }
+
+    std::uint32_t next() {
+	const std::uint32_t result = rotl32(m_s[1] * 5, 7) * 9;
+	const std::uint32_t t = m_s[1] << 9;
+	m_s[2] ^= m_s[0];
+	m_s[3] ^= m_s[1];
+	m_s[1] ^= m_s[2];
+	m_s[0] ^= m_s[3];
+	m_s[2] ^= t;
+	m_s[3] = rotl32(m_s[3], 11);
+	return result;
+    }
+
+    // Uniform int in [low, high], unbiased (Lemire's multiply and reject)
+    int range(int low, int high) {
+	const std::uint32_t span = static_cast<std::uint32_t>(high - low) + 1;
+	std::uint64_t m = static_cast<std::uint64_t>(next()) * span;
+	if (static_cast<std::uint32_t>(m) < span) {
+	    const std::uint32_t threshold = -span % span;
+	    while (static_cast<std::uint32_t>(m) < threshold) {
+		m = static_cast<std::uint64_t>(next()) * span;
+	    }
+	}
+	return low + static_cast<int>(m >> 32);
+    }
+
+    // Opaque RGB from one draw
+    Color color() {
+	const std::uint32_t x = next();
+	return Color(x >> 24, x >> 16, x >> 8);
+    }
+};
+
+// Eight independent xoshiro128** generators stepped together. Lane
+// outputs are interleaved, so the stream is the same whether it is
+// produced by the AVX2, SSE2 or scalar kernel.
+class RandomLanes
+{
+public:
+    static constexpr std::size_t kLanes {8};
+    static constexpr std::size_t kStateWords {4 * kLanes};
+
+private:
+    alignas(32) std::uint32_t m_s[4][kLanes] {};
+
+    void fill_scalar(std::uint32_t* out, std::size_t blocks) {
+	for (std::size_t b = 0; b < blocks; ++b) {
+	    for (std::size_t l = 0; l < kLanes; ++l) {
+		std::uint32_t& s0 = m_s[0][l];
+		std::uint32_t& s1 = m_s[1][l];
+		std::uint32_t& s2 = m_s[2][l];
+		std::uint32_t& s3 = m_s[3][l];
+		out[b * kLanes + l] = rotl32(s1 * 5, 7) * 9;
+		const std::uint32_t t = s1 << 9;
+		s2 ^= s0;
+		s3 ^= s1;
+		s1 ^= s2;
+		s0 ^= s3;
+		s2 ^= t;
+		s3 = rotl32(s3, 11);
+	    }
+	}
+    }
+
+#ifdef SQUARE_SIMD_X86
+    __attribute__((target("sse2")))
+    static __m128i rotl_sse2(__m128i x, int k) {
+	return _mm_or_si128(_mm_slli_epi32(x, k), _mm_srli_epi32(x, 32 - k));
+    }
+
+    // Two 4-lane halves side by side
+    __attribute__((target("sse2")))
+    void fill_sse2(std::uint32_t* out, std::size_t blocks) {
+	for (std::size_t half = 0; half < kLanes; half += 4) {
+	    __m128i s0 = _mm_load_si128(reinterpret_cast<const __m128i*>(&m_s[0][half]));
+	    __m128i s1 = _mm_load_si128(reinterpret_cast<const __m128i*>(&m_s[1][half]));
+	    __m128i s2 = _mm_load_si128(reinterpret_cast<const __m128i*>(&m_s[2][half]));
+	    __m128i s3 = _mm_load_si128(reinterpret_cast<const __m128i*>(&m_s[3][half]));
+	    for (std::size_t b = 0; b < blocks; ++b) {
+		// x * 5 and x * 9 as shift and add
+		__m128i x = _mm_add_epi32(s1, _mm_slli_epi32(s1, 2));
+		x = rotl_sse2(x, 7);
+		x = _mm_add_epi32(x, _mm_slli_epi32(x, 3));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + b * kLanes + half), x);
+		const __m128i t = _mm_slli_epi32(s1, 9);
+		s2 = _mm_xor_si128(s2, s0);
+		s3 = _mm_xor_si128(s3, s1);
+		s1 = _mm_xor_si128(s1, s2);
+		s0 = _mm_xor_si128(s0, s3);
+		s2 = _mm_xor_si128(s2, t);
+		s3 = rotl_sse2(s3, 11);
+	    }
+	    _mm_store_si128(reinterpret_cast<__m128i*>(&m_s[0][half]), s0);
+	    _mm_store_si128(reinterpret_cast<__m128i*>(&m_s[1][half]), s1);
+	    _mm_store_si128(reinterpret_cast<__m128i*>(&m_s[2][half]), s2);
+	    _mm_store_si128(reinterpret_cast<__m128i*>(&m_s[3][half]), s3);
+	}
+    }
+
+    __attribute__((target("avx2")))
+    static __m256i rotl_avx2(__m256i x, int k) {
+	return _mm256_or_si256(_mm256_slli_epi32(x, k), _mm256_srli_epi32(x, 32 - k));
+    }
+
+    __attribute__((target("avx2")))
+    void fill_avx2(std::uint32_t* out, std::size_t blocks) {
+	__m256i s0 = _mm256_load_si256(reinterpret_cast<const __m256i*>(m_s[0]));
+	__m256i s1 = _mm256_load_si256(reinterpret_cast<const __m256i*>(m_s[1]));
+	__m256i s2 = _mm256_load_si256(reinterpret_cast<const __m256i*>(m_s[2]));
+	__m256i s3 = _mm256_load_si256(reinterpret_cast<const __m256i*>(m_s[3]));
+	for (std::size_t b = 0; b < blocks; ++b) {
+	    __m256i x = _mm256_add_epi32(s1, _mm256_slli_epi32(s1, 2));
+	    x = rotl_avx2(x, 7);
+	    x = _mm256_add_epi32(x, _mm256_slli_epi32(x, 3));
+	    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + b * kLanes), x);
+	    const __m256i t = _mm256_slli_epi32(s1, 9);
+	    s2 = _mm256_xor_si256(s2, s0);
+	    s3 = _mm256_xor_si256(s3, s1);
+	    s1 = _mm256_xor_si256(s1, s2);
+	    s0 = _mm256_xor_si256(s0, s3);
+	    s2 = _mm256_xor_si256(s2, t);
+	    s3 = rotl_avx2(s3, 11);
+	}
+	_mm256_store_si256(reinterpret_cast<__m256i*>(m_s[0]), s0);
+	_mm256_store_si256(reinterpret_cast<__m256i*>(m_s[1]), s1);
+	_mm256_store_si256(reinterpret_cast<__m256i*>(m_s[2]), s2);
+	_mm256_store_si256(reinterpret_cast<__m256i*>(m_s[3]), s3);
+    }
+#endif
+
+public:
+    RandomLanes() = default;
+    RandomLanes(std::uint64_t seed, std::uint64_t stream) { reseed(seed, stream); }
+
+    void getState(std::uint32_t* out) const { std::memcpy(out, m_s, sizeof(m_s)); }
+    void setState(const std::uint32_t* in) { std::memcpy(m_s, in, sizeof(m_s)); }
+
+    void reseed(std::uint64_t seed, std::uint64_t stream) {
+	for (std::size_t l = 0; l < kLanes; ++l) {
+	    // Different seed from the per-thread generators so no lane
+	    // shares a sequence with one of them
+	    RandomGenerator lane(seed ^ 0x5851f42d4c957f2dull, stream * kLanes + l);
+	    for (std::size_t w = 0; w < 4; ++w) {
+		m_s[w][l] = lane.next();
+	    }
+	}
+    }
+
+    // Fill out with blocks * kLanes random words
+    void fill(std::uint32_t* out, std::size_t blocks, SimdLevel max_level = SimdLevel::AVX2) {
+	SimdLevel level = detect_simd_level();
+	if (level > max_level) {
+	    level = max_level;
+	}
+	switch (level) {
+#ifdef SQUARE_SIMD_X86
+	case SimdLevel::AVX2:
+	    fill_avx2(out, blocks);
+	    return;
+	case SimdLevel::SSE2:
+	    fill_sse2(out, blocks);
+	    return;
+#endif
+	default:
+	    fill_scalar(out, blocks);
+	    return;
+	}
+    }
+
+    // Opaque random colors
+    void colors(Color* out, std::size_t n) {
+	std::uint32_t words[256];
+	while (n > 0) {
+	    std::size_t count = n < 256 ? n : 256;
+	    fill(words, (count + kLanes - 1) / kLanes);
+	    for (std::size_t i = 0; i < count; ++i) {
+		out[i] = Color(words[i] >> 24, words[i] >> 16, words[i] >> 8);
+	    }
+	    out += count;
+	    n -= count;
+	}
+    }
+
+    // Whole-number values in [low, high] by multiply and shift. Skips
+    // the rejection step, so the bias is below span / 2^32.
+    void ints(double* out, std::size_t n, int low, int high) {
+	const std::uint64_t span = static_cast<std::uint64_t>(high - low) + 1;
+	std::uint32_t words[256];
+	while (n > 0) {
+	    std::size_t count = n < 256 ? n : 256;
+	    fill(words, (count + kLanes - 1) / kLanes);
+	    for (std::size_t i = 0; i < count; ++i) {
+		out[i] = static_cast<double>(low + static_cast<int>((words[i] * span) >> 32));
+	    }
+	    out += count;
+	    n -= count;
+	}
+    }
+};
+
+// Seed shared by every thread's generator; each thread mixes in its own
+// stream number. Changing it with seed_random() reseeds every thread on
+// its next draw.
+inline std::atomic<std::uint64_t> gRandomBaseSeed {std::random_device {}()
+						    ^ (static_cast<std::uint64_t>(std::random_device {}()) << 32)};
+inline std::atomic<std::uint32_t> gRandomEpoch {0};
+inline std::atomic<std::uint64_t> gRandomNextStream {0};
+
+struct ThreadRandom {
+    RandomGenerator generator;
+    RandomLanes lanes;
+    std::uint64_t stream {gRandomNextStream.fetch_add(1)};
+    std::uint32_t epoch {~0u};
+};
+
+// This thread's generators, (re)seeded lazily. With a fixed seed the
+// sequence on each thread is reproducible as long as threads make
+// their first draw in the same order; the main thread always does
+// first in this program.
+inline ThreadRandom& thread_random(void)
+{
+    thread_local ThreadRandom random;
+    std::uint32_t epoch = gRandomEpoch.load(std::memory_order_acquire);
+    if (random.epoch != epoch) {
+	std::uint64_t seed = gRandomBaseSeed.load(std::memory_order_relaxed);
+	random.generator.reseed(seed, random.stream);
+	random.lanes.reseed(seed, random.stream);
+	random.epoch = epoch;
+    }
+    return random;
+}
+
+// Reproducible-seed mode: every thread restarts its sequence from seed
+inline void seed_random(std::uint64_t seed)
+{
+    gRandomBaseSeed.store(seed, std::memory_order_relaxed);
+    gRandomEpoch.fetch_add(1, std::memory_order_release);
+}
+
+#endif // FAST_RANDOM_H
@@ -0,0 +1,46 @@
+#ifndef FIXED_TIMESTEP_H
+#define FIXED_TIMESTEP_H
+
+#include <cstdint>
+
+// Accumulator for running physics at a fixed rate independent of how
+// often frames get drawn. Feed it the real time each frame took and it
+// says how many physics steps to run.
+struct FixedTimestep {
+    double step_seconds {1.0 / 60.0};
+    // Spiral-of-death cap: never run more steps than this per frame, so
+    // a slow frame can't make the next one slower still
+    int max_steps_per_frame {5};
+    // Frames longer than this (breakpoints, window drags) count as this
+    double max_frame_seconds {0.25};
+    double accumulator {0.0};
+    // Simulated time thrown away because of the caps above
+    std::uint64_t dropped_steps {0};
+
+    FixedTimestep() = default;
+    FixedTimestep(double hz, int max_steps)
+	: step_seconds {1.0 / hz}
+	, max_steps_per_frame {max_steps} {}
+
+    // Returns the number of physics steps to run for a frame that took
+    // frame_seconds.
+    int advance(double frame_seconds) {
+	if (frame_seconds > max_frame_seconds) {
+	    frame_seconds = max_frame_seconds;
+	}
+	accumulator += frame_seconds;
+	int steps = 0;
+	while (accumulator >= step_seconds && steps < max_steps_per_frame) {
+	    accumulator -= step_seconds;
+	    ++steps;
+	}
+	// Fell behind; drop whole steps but keep the fraction
+	while (accumulator >= step_seconds) {
+	    accumulator -= step_seconds;
+	    ++dropped_steps;
+	}
+	return steps;
+    }
+};
+
+#endif // FIXED_TIMESTEP_H
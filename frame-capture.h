@@ -0,0 +1,409 @@
+#ifndef FRAME_CAPTURE_H
+#define FRAME_CAPTURE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "SDL2/SDL.h"
+
+#include "software-raster.h"
+#include "spsc-queue.h"
+#include "square-store.h"
+
+// Writes rendered frames to numbered image files on a background
+// thread. Frames are copied into a ring of preallocated slots and
+// handed to the writer through a pair of SpscQueues, one for full slots
+// and one for slots it has finished with. The render thread never
+// waits: if every slot is still queued for writing, the frame is
+// dropped and counted instead, and its number is left out of the file
+// sequence.
+//
+// Files are named frame-NNNNNN.ppm or .png after the frame number
+// counted from start(). PNGs use stored (uncompressed) deflate blocks,
+// which keeps zlib out of the build and the encoder about as cheap as
+// the PPM one. The writer encodes into a buffer sized at start() and
+// writes with plain POSIX calls, so neither thread touches the heap
+// while capturing.
+class FrameCapture
+{
+public:
+    enum class Format {
+	Ppm,
+	Png,
+    };
+
+    static constexpr std::size_t kMaxSlots {16};
+
+private:
+    struct Slot {
+	AlignedVector<Uint32> pixels;
+	std::uint64_t frame {0};
+    };
+
+    std::vector<Slot> m_slots;
+    SpscQueue<std::uint32_t, kMaxSlots> m_full;
+    SpscQueue<std::uint32_t, kMaxSlots> m_free;
+    // Bumped on every hand over so the writer can sleep on it
+    std::atomic<std::uint32_t> m_signal {0};
+    std::atomic<bool> m_stop {false};
+    std::thread m_writer;
+    bool m_active {false};
+    std::string m_directory;
+    Format m_format {Format::Ppm};
+    int m_width {0};
+    int m_height {0};
+
+    // Render thread
+    std::uint32_t m_current {0};
+    bool m_in_frame {false};
+    // A cancelled slot, kept here for the next frame: only the writer
+    // pushes to m_free, which has room for one producer
+    std::uint32_t m_spare {0};
+    bool m_has_spare {false};
+    std::uint64_t m_next_frame {0};
+    std::uint64_t m_dropped {0};
+    // The first dropped frame numbers, for the report
+    std::vector<std::uint64_t> m_dropped_frames;
+
+    // Writer thread
+    std::vector<unsigned char> m_encoded;
+    // PNG scanlines before they are split into blocks
+    std::vector<unsigned char> m_raw;
+    std::atomic<std::uint64_t> m_written {0};
+    std::atomic<std::uint64_t> m_failed {0};
+
+    static const std::uint32_t* crc_table() {
+	static const auto table = [] {
+	    std::vector<std::uint32_t> t(256);
+	    for (std::uint32_t n = 0; n < 256; ++n) {
+		std::uint32_t c = n;
+		for (int k = 0; k < 8; ++k) {
+		    c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		}
+		t[n] = c;
+	    }
+	    return t;
+	}();
+	return table.data();
+    }
+
+    static std::uint32_t crc32(const unsigned char* data, std::size_t n) {
+	const std::uint32_t* table = crc_table();
+	std::uint32_t c = 0xffffffffu;
+	for (std::size_t i = 0; i < n; ++i) {
+	    c = table[(c ^ data[i]) & 0xff] ^ (c >> 8);
+	}
+	return c ^ 0xffffffffu;
+    }
+
+    static unsigned char* put(unsigned char* out, const void* data, std::size_t n) {
+	std::memcpy(out, data, n);
+	return out + n;
+    }
+
+    static unsigned char* put_be32(unsigned char* out, std::uint32_t v) {
+	out[0] = static_cast<unsigned char>(v >> 24);
+	out[1] = static_cast<unsigned char>(v >> 16);
+	out[2] = static_cast<unsigned char>(v >> 8);
+	out[3] = static_cast<unsigned char>(v);
+	return out + 4;
+    }
+
+    unsigned char* put_rgb_row(unsigned char* out, const Uint32* row) const {
+	for (int x = 0; x < m_width; ++x) {
+	    out[0] = static_cast<unsigned char>(row[x] >> 16);
+	    out[1] = static_cast<unsigned char>(row[x] >> 8);
+	    out[2] = static_cast<unsigned char>(row[x]);
+	    out += 3;
+	}
+	return out;
+    }
+
+    unsigned char* encode_ppm(unsigned char* out, const Uint32* pixels) {
+	char header[64];
+	int n = std::snprintf(header, sizeof(header), "P6\n%d %d\n255\n", m_width, m_height);
+	out = put(out, header, static_cast<std::size_t>(n));
+	for (int y = 0; y < m_height; ++y) {
+	    out = put_rgb_row(out, pixels + static_cast<std::size_t>(y) * m_width);
+	}
+	return out;
+    }
+
+    // Writes a chunk's length and type; the data follows at the result
+    static unsigned char* begin_png_chunk(unsigned char* out, std::uint32_t length,
+					  const char* type) {
+	out = put_be32(out, length);
+	std::memcpy(out, type, 4);
+	return out + 4;
+    }
+
+    // data is the start of the chunk's data, out its end
+    static unsigned char* end_png_chunk(unsigned char* out, const unsigned char* data) {
+	return put_be32(out, crc32(data - 4, static_cast<std::size_t>(out - data) + 4));
+    }
+
+    static std::uint32_t adler32(const unsigned char* data, std::size_t n) {
+	std::uint32_t a = 1;
+	std::uint32_t b = 0;
+	while (n > 0) {
+	    // The most bytes that can't overflow b before the modulo
+	    const std::size_t run = std::min<std::size_t>(n, 5552);
+	    for (std::size_t i = 0; i < run; ++i) {
+		a += data[i];
+		b += a;
+	    }
+	    a %= 65521;
+	    b %= 65521;
+	    data += run;
+	    n -= run;
+	}
+	return (b << 16) | a;
+    }
+
+    unsigned char* encode_png(unsigned char* out, const Uint32* pixels) {
+	static const unsigned char signature[8] {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	out = put(out, signature, 8);
+	unsigned char* data = out = begin_png_chunk(out, 13, "IHDR");
+	out = put_be32(out, static_cast<std::uint32_t>(m_width));
+	out = put_be32(out, static_cast<std::uint32_t>(m_height));
+	// 8 bits per channel RGB, default compression and filter, no
+	// interlacing
+	const unsigned char format[5] {8, 2, 0, 0, 0};
+	out = put(out, format, 5);
+	out = end_png_chunk(out, data);
+
+	// Scanlines each led by filter type 0, laid down as stored blocks
+	// of at most 65535 bytes in a zlib stream
+	unsigned char* raw = m_raw.data();
+	for (int y = 0; y < m_height; ++y) {
+	    *raw++ = 0;
+	    raw = put_rgb_row(raw, pixels + static_cast<std::size_t>(y) * m_width);
+	}
+	const std::size_t raw_size = static_cast<std::size_t>(raw - m_raw.data());
+	const std::size_t blocks = raw_size / 65535 + 1;
+	data = out = begin_png_chunk(out, static_cast<std::uint32_t>(2 + blocks * 5 + raw_size + 4),
+				     "IDAT");
+	*out++ = 0x78;
+	*out++ = 0x01;
+	for (std::size_t done = 0, b = 0; b < blocks; ++b) {
+	    const std::size_t n = std::min<std::size_t>(raw_size - done, 65535);
+	    *out++ = b + 1 == blocks ? 1 : 0;
+	    *out++ = static_cast<unsigned char>(n);
+	    *out++ = static_cast<unsigned char>(n >> 8);
+	    *out++ = static_cast<unsigned char>(~n);
+	    *out++ = static_cast<unsigned char>(~n >> 8);
+	    out = put(out, m_raw.data() + done, n);
+	    done += n;
+	}
+	out = put_be32(out, adler32(m_raw.data(), raw_size));
+	out = end_png_chunk(out, data);
+
+	data = out = begin_png_chunk(out, 0, "IEND");
+	return end_png_chunk(out, data);
+    }
+
+    // Upper bound on an encoded frame, so the buffer never grows
+    std::size_t encoded_capacity() const {
+	const std::size_t raw = (static_cast<std::size_t>(m_width) * 3 + 1) * m_height;
+	return raw + (raw / 65535 + 1) * 5 + 128;
+    }
+
+    void write_slot(const Slot& slot) {
+	unsigned char* end = m_format == Format::Png
+	    ? encode_png(m_encoded.data(), slot.pixels.data())
+	    : encode_ppm(m_encoded.data(), slot.pixels.data());
+	const std::size_t size = static_cast<std::size_t>(end - m_encoded.data());
+	char path[4096];
+	std::snprintf(path, sizeof(path), "%s/frame-%06llu.%s",
+		      m_directory.c_str(),
+		      static_cast<unsigned long long>(slot.frame),
+		      m_format == Format::Png ? "png" : "ppm");
+	const int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	bool ok = fd >= 0;
+	for (std::size_t done = 0; ok && done < size;) {
+	    const ssize_t n = ::write(fd, m_encoded.data() + done, size - done);
+	    ok = n > 0;
+	    done += ok ? static_cast<std::size_t>(n) : 0;
+	}
+	if (fd >= 0) {
+	    ok = ::close(fd) == 0 && ok;
+	}
+	(ok ? m_written : m_failed).fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void writer_loop() {
+	for (;;) {
+	    const std::uint32_t seen = m_signal.load(std::memory_order_acquire);
+	    while (const std::uint32_t* next = m_full.front()) {
+		const std::uint32_t slot = *next;
+		m_full.pop();
+		write_slot(m_slots[slot]);
+		m_free.try_push(slot);
+	    }
+	    if (m_stop.load(std::memory_order_acquire)) {
+		// Everything handed over before stop() has been written
+		if (m_full.front() == nullptr) {
+		    return;
+		}
+		continue;
+	    }
+	    m_signal.wait(seen, std::memory_order_acquire);
+	}
+    }
+
+    void signal() {
+	m_signal.fetch_add(1, std::memory_order_release);
+	m_signal.notify_one();
+    }
+
+public:
+    FrameCapture() = default;
+    FrameCapture(const FrameCapture&) = delete;
+    FrameCapture& operator=(const FrameCapture&) = delete;
+    ~FrameCapture() { stop(); }
+
+    bool active() const { return m_active; }
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    // Row stride of begin_frame()'s pixels, in bytes
+    int pitchBytes() const { return static_cast<int>(m_width * sizeof(Uint32)); }
+    // Frames offered since start(), written or not
+    std::uint64_t frameCount() const { return m_next_frame; }
+    std::uint64_t droppedCount() const { return m_dropped; }
+    const std::vector<std::uint64_t>& droppedFrames() const { return m_dropped_frames; }
+    std::uint64_t writtenCount() const { return m_written.load(std::memory_order_relaxed); }
+    std::uint64_t failedCount() const { return m_failed.load(std::memory_order_relaxed); }
+
+    // Allocate slots frames of width x height and start the writer.
+    // Returns false if directory can't be created.
+    bool start(const std::string& directory, Format format,
+	       int width, int height, std::size_t slots = 8) {
+	stop();
+	std::error_code error;
+	std::filesystem::create_directories(directory, error);
+	if (error) {
+	    return false;
+	}
+	m_directory = directory;
+	m_format = format;
+	m_width = width;
+	m_height = height;
+	slots = std::clamp<std::size_t>(slots, 1, kMaxSlots);
+	m_slots.resize(slots);
+	for (std::size_t s = 0; s < slots; ++s) {
+	    m_slots[s].pixels.assign(static_cast<std::size_t>(width) * height, 0);
+	    m_free.try_push(static_cast<std::uint32_t>(s));
+	}
+	m_encoded.resize(encoded_capacity());
+	m_raw.resize((static_cast<std::size_t>(width) * 3 + 1) * height);
+	crc_table();
+	m_next_frame = 0;
+	m_dropped = 0;
+	m_dropped_frames.clear();
+	m_dropped_frames.reserve(1024);
+	m_written = 0;
+	m_failed = 0;
+	m_stop = false;
+	m_in_frame = false;
+	m_has_spare = false;
+	m_writer = std::thread([this] { writer_loop(); });
+	m_active = true;
+	return true;
+    }
+
+    // Write out the frames already handed over, then stop the writer
+    void stop() {
+	if (!m_active) {
+	    return;
+	}
+	m_stop.store(true, std::memory_order_release);
+	signal();
+	m_writer.join();
+	m_active = false;
+	// Every slot is free again for the next start()
+	while (m_free.front() != nullptr) {
+	    m_free.pop();
+	}
+	m_has_spare = false;
+    }
+
+    // Render thread: pixels to fill with the next frame, width() by
+    // height() at pitchBytes(), or nullptr if it has to be dropped
+    Uint32* begin_frame() {
+	const std::uint64_t frame = m_next_frame++;
+	if (m_has_spare) {
+	    m_has_spare = false;
+	    m_current = m_spare;
+	    m_slots[m_current].frame = frame;
+	    m_in_frame = true;
+	    return m_slots[m_current].pixels.data();
+	}
+	const std::uint32_t* free_slot = m_free.front();
+	if (free_slot == nullptr) {
+	    ++m_dropped;
+	    if (m_dropped_frames.size() < m_dropped_frames.capacity()) {
+		m_dropped_frames.push_back(frame);
+	    }
+	    return nullptr;
+	}
+	m_current = *free_slot;
+	m_free.pop();
+	m_slots[m_current].frame = frame;
+	m_in_frame = true;
+	return m_slots[m_current].pixels.data();
+    }
+
+    // Render thread: hand the frame from begin_frame() to the writer
+    void end_frame() {
+	if (!m_in_frame) {
+	    return;
+	}
+	m_in_frame = false;
+	m_full.try_push(m_current);
+	signal();
+    }
+
+    // Render thread: give the slot back without writing it, e.g. when
+    // the readback failed. The frame counts as dropped.
+    void cancel_frame() {
+	if (!m_in_frame) {
+	    return;
+	}
+	m_in_frame = false;
+	m_spare = m_current;
+	m_has_spare = true;
+	++m_dropped;
+	if (m_dropped_frames.size() < m_dropped_frames.capacity()) {
+	    m_dropped_frames.push_back(m_slots[m_current].frame);
+	}
+    }
+
+    // Render thread: capture the framebuffer as the next frame
+    void capture(const Framebuffer& framebuffer) {
+	Uint32* pixels = begin_frame();
+	if (pixels == nullptr) {
+	    return;
+	}
+	const std::size_t width = static_cast<std::size_t>(std::min(m_width, framebuffer.width()));
+	const int height = std::min(m_height, framebuffer.height());
+	for (int y = 0; y < height; ++y) {
+	    std::memcpy(pixels + static_cast<std::size_t>(y) * m_width,
+			framebuffer.row(y), width * sizeof(Uint32));
+	}
+	end_frame();
+    }
+};
+
+#endif // FRAME_CAPTURE_H
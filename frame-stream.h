@@ -0,0 +1,344 @@
+#ifndef FRAME_STREAM_H
+#define FRAME_STREAM_H
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <csignal>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "SDL2/SDL.h"
+
+#include "software-raster.h"
+#include "spsc-queue.h"
+#include "square-store.h"
+
+// Streams frames as raw RGBA (8 bits per channel, rows top to bottom,
+// no header) to a file descriptor, e.g. a pipe into
+//   ffmpeg -f rawvideo -pix_fmt rgba -s 640x480 -r 60 -i - out.mp4
+//
+// Double buffered: the render thread fills one buffer while a writer
+// thread sends the other, so a slow reader only costs the render thread
+// once both buffers are waiting. Buffer rows are cache-line aligned
+// like a Framebuffer's, and the writer hands them to writev() as is, so
+// the padding is skipped without another copy. What happens when both
+// buffers are busy is up to the policy: Block waits for the writer,
+// which paces drawing to the reader but never the simulation thread,
+// while Drop skips the frame. Either way the stats show how much
+// backpressure there was.
+//
+// A reader closing the pipe ends the stream instead of killing the
+// process: start() ignores SIGPIPE for the whole process.
+class FrameStream
+{
+public:
+    enum class Policy {
+	Block,
+	Drop,
+    };
+
+    Policy policy {Policy::Block};
+
+private:
+    static constexpr std::uint32_t kBuffers {2};
+
+    std::vector<AlignedVector<Uint32>> m_buffers;
+    SpscQueue<std::uint32_t, kBuffers> m_full;
+    SpscQueue<std::uint32_t, kBuffers> m_free;
+    // Bumped on every hand over in either direction, for both sides to
+    // sleep on
+    std::atomic<std::uint32_t> m_to_writer {0};
+    std::atomic<std::uint32_t> m_to_render {0};
+    std::atomic<bool> m_stop {false};
+    std::atomic<bool> m_broken {false};
+    std::thread m_writer;
+    bool m_active {false};
+    int m_fd {-1};
+    int m_width {0};
+    int m_height {0};
+    // Row stride in pixels
+    std::size_t m_pitch {0};
+
+    // Render thread
+    std::uint32_t m_current {0};
+    bool m_in_frame {false};
+    // A cancelled buffer, kept here for the next frame: only the writer
+    // pushes to m_free, which has room for one producer
+    std::uint32_t m_spare {0};
+    bool m_has_spare {false};
+    std::uint64_t m_frames {0};
+    std::uint64_t m_dropped {0};
+    std::uint64_t m_blocked {0};
+    double m_blocked_seconds {0.0};
+    double m_max_blocked_seconds {0.0};
+
+    // Writer thread
+    std::vector<iovec> m_iov;
+    std::atomic<std::uint64_t> m_written {0};
+    std::atomic<std::uint64_t> m_bytes {0};
+    std::atomic<std::uint64_t> m_writes {0};
+    std::atomic<std::uint64_t> m_short_writes {0};
+
+    // Rows of buffer as few iovecs as possible: one if rows are packed
+    void build_iov(const AlignedVector<Uint32>& buffer) {
+	m_iov.clear();
+	const std::size_t row_bytes = static_cast<std::size_t>(m_width) * sizeof(Uint32);
+	for (int y = 0; y < m_height; ++y) {
+	    char* row = reinterpret_cast<char*>(const_cast<Uint32*>(buffer.data() + y * m_pitch));
+	    if (!m_iov.empty()
+		&& static_cast<char*>(m_iov.back().iov_base) + m_iov.back().iov_len == row) {
+		m_iov.back().iov_len += row_bytes;
+	    } else {
+		m_iov.push_back({row, row_bytes});
+	    }
+	}
+    }
+
+    // Write the whole frame, picking up after short writes. Returns
+    // false if the descriptor failed.
+    bool write_frame(const AlignedVector<Uint32>& buffer) {
+	build_iov(buffer);
+	iovec* iov = m_iov.data();
+	std::size_t count = m_iov.size();
+	while (count > 0) {
+	    const std::size_t batch = std::min<std::size_t>(count, IOV_MAX);
+	    std::size_t offered = 0;
+	    for (std::size_t i = 0; i < batch; ++i) {
+		offered += iov[i].iov_len;
+	    }
+	    const ssize_t n = ::writev(m_fd, iov, static_cast<int>(batch));
+	    m_writes.fetch_add(1, std::memory_order_relaxed);
+	    if (n < 0) {
+		if (errno == EINTR) {
+		    continue;
+		}
+		return false;
+	    }
+	    m_bytes.fetch_add(static_cast<std::uint64_t>(n), std::memory_order_relaxed);
+	    if (static_cast<std::size_t>(n) < offered) {
+		// The reader took less than we offered: it's behind
+		m_short_writes.fetch_add(1, std::memory_order_relaxed);
+	    }
+	    std::size_t left = static_cast<std::size_t>(n);
+	    while (count > 0 && left >= iov->iov_len) {
+		left -= iov->iov_len;
+		++iov;
+		--count;
+	    }
+	    if (left > 0) {
+		iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+		iov->iov_len -= left;
+	    }
+	}
+	return true;
+    }
+
+    void writer_loop() {
+	for (;;) {
+	    const std::uint32_t seen = m_to_writer.load(std::memory_order_acquire);
+	    while (const std::uint32_t* next = m_full.front()) {
+		const std::uint32_t buffer = *next;
+		m_full.pop();
+		if (!m_broken.load(std::memory_order_relaxed)) {
+		    if (write_frame(m_buffers[buffer])) {
+			m_written.fetch_add(1, std::memory_order_relaxed);
+		    } else {
+			m_broken.store(true, std::memory_order_relaxed);
+		    }
+		}
+		m_free.try_push(buffer);
+		m_to_render.fetch_add(1, std::memory_order_release);
+		m_to_render.notify_one();
+	    }
+	    if (m_stop.load(std::memory_order_acquire)) {
+		if (m_full.front() == nullptr) {
+		    return;
+		}
+		continue;
+	    }
+	    m_to_writer.wait(seen, std::memory_order_acquire);
+	}
+    }
+
+    // Swap R and B: ARGB words (0xAARRGGBB) are B, G, R, A in memory on
+    // little endian machines, which is what SDL and the framebuffer use.
+    // The result words are 0xAABBGGRR, so R, G, B, A in memory: the
+    // rgba byte order the stream promises. Big endian would need the
+    // whole word reversed instead.
+    static_assert(std::endian::native == std::endian::little,
+		  "argb_to_rgba() writes RGBA bytes only on little endian machines");
+    static void argb_to_rgba(Uint32* dst, const Uint32* src, std::size_t n) {
+	for (std::size_t i = 0; i < n; ++i) {
+	    const Uint32 v = src[i];
+	    dst[i] = (v & 0xff00ff00u) | ((v >> 16) & 0xffu) | ((v & 0xffu) << 16);
+	}
+    }
+
+public:
+    FrameStream() = default;
+    FrameStream(const FrameStream&) = delete;
+    FrameStream& operator=(const FrameStream&) = delete;
+    ~FrameStream() { stop(); }
+
+    bool active() const { return m_active; }
+    // The reader went away or the descriptor failed; frames are no
+    // longer written
+    bool broken() const { return m_broken.load(std::memory_order_relaxed); }
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    // Row stride of begin_frame()'s pixels, in bytes
+    int pitchBytes() const { return static_cast<int>(m_pitch * sizeof(Uint32)); }
+
+    // Frames offered since start(), written or not
+    std::uint64_t frameCount() const { return m_frames; }
+    std::uint64_t droppedCount() const { return m_dropped; }
+    // Frames that had to wait for a free buffer, and for how long
+    std::uint64_t blockedCount() const { return m_blocked; }
+    double blockedSeconds() const { return m_blocked_seconds; }
+    double maxBlockedSeconds() const { return m_max_blocked_seconds; }
+    std::uint64_t writtenCount() const { return m_written.load(std::memory_order_relaxed); }
+    std::uint64_t bytesWritten() const { return m_bytes.load(std::memory_order_relaxed); }
+    std::uint64_t writeCalls() const { return m_writes.load(std::memory_order_relaxed); }
+    // writev() calls that took less than offered because the reader
+    // was behind
+    std::uint64_t shortWrites() const { return m_short_writes.load(std::memory_order_relaxed); }
+
+    // Stream width x height frames to fd, which stays open and owned by
+    // the caller
+    void start(int fd, int width, int height) {
+	stop();
+	std::signal(SIGPIPE, SIG_IGN);
+	m_fd = fd;
+	m_width = width;
+	m_height = height;
+	constexpr std::size_t line = gCacheLineSize / sizeof(Uint32);
+	m_pitch = (static_cast<std::size_t>(width) + line - 1) / line * line;
+	m_buffers.resize(kBuffers);
+	for (std::uint32_t b = 0; b < kBuffers; ++b) {
+	    m_buffers[b].assign(m_pitch * height, 0);
+	    m_free.try_push(b);
+	}
+	m_iov.reserve(height);
+	m_frames = 0;
+	m_dropped = 0;
+	m_blocked = 0;
+	m_blocked_seconds = 0.0;
+	m_max_blocked_seconds = 0.0;
+	m_written = 0;
+	m_bytes = 0;
+	m_writes = 0;
+	m_short_writes = 0;
+	m_stop = false;
+	m_broken = false;
+	m_in_frame = false;
+	m_has_spare = false;
+	m_writer = std::thread([this] { writer_loop(); });
+	m_active = true;
+    }
+
+    // Send what was handed over, then stop the writer
+    void stop() {
+	if (!m_active) {
+	    return;
+	}
+	m_stop.store(true, std::memory_order_release);
+	m_to_writer.fetch_add(1, std::memory_order_release);
+	m_to_writer.notify_one();
+	m_writer.join();
+	m_active = false;
+	while (m_free.front() != nullptr) {
+	    m_free.pop();
+	}
+	m_has_spare = false;
+    }
+
+    // Render thread: pixels to fill with the next frame in RGBA byte
+    // order, width() by height() at pitchBytes(), or nullptr if it is
+    // dropped
+    Uint32* begin_frame() {
+	++m_frames;
+	if (broken()) {
+	    ++m_dropped;
+	    return nullptr;
+	}
+	if (m_has_spare) {
+	    m_has_spare = false;
+	    m_current = m_spare;
+	    m_in_frame = true;
+	    return m_buffers[m_current].data();
+	}
+	const std::uint32_t* free_buffer = m_free.front();
+	if (free_buffer == nullptr && policy == Policy::Block) {
+	    const auto start = std::chrono::steady_clock::now();
+	    for (;;) {
+		// Read the counter first so a hand back between the check
+		// and the wait still wakes us
+		const std::uint32_t seen = m_to_render.load(std::memory_order_acquire);
+		if ((free_buffer = m_free.front()) != nullptr) {
+		    break;
+		}
+		m_to_render.wait(seen, std::memory_order_acquire);
+	    }
+	    const double waited = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+	    ++m_blocked;
+	    m_blocked_seconds += waited;
+	    m_max_blocked_seconds = std::max(m_max_blocked_seconds, waited);
+	}
+	if (free_buffer == nullptr) {
+	    ++m_dropped;
+	    return nullptr;
+	}
+	m_current = *free_buffer;
+	m_free.pop();
+	m_in_frame = true;
+	return m_buffers[m_current].data();
+    }
+
+    // Render thread: hand the frame from begin_frame() to the writer
+    void end_frame() {
+	if (!m_in_frame) {
+	    return;
+	}
+	m_in_frame = false;
+	m_full.try_push(m_current);
+	m_to_writer.fetch_add(1, std::memory_order_release);
+	m_to_writer.notify_one();
+    }
+
+    // Render thread: give the buffer back unsent. Counts as dropped.
+    void cancel_frame() {
+	if (!m_in_frame) {
+	    return;
+	}
+	m_in_frame = false;
+	m_spare = m_current;
+	m_has_spare = true;
+	++m_dropped;
+    }
+
+    // Render thread: send the framebuffer as the next frame
+    void submit(const Framebuffer& framebuffer) {
+	Uint32* pixels = begin_frame();
+	if (pixels == nullptr) {
+	    return;
+	}
+	const std::size_t width = static_cast<std::size_t>(std::min(m_width, framebuffer.width()));
+	const int height = std::min(m_height, framebuffer.height());
+	for (int y = 0; y < height; ++y) {
+	    argb_to_rgba(pixels + y * m_pitch, framebuffer.row(y), width);
+	}
+	end_frame();
+    }
+};
+
+#endif // FRAME_STREAM_H
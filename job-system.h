@@ -0,0 +1,199 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "square-store.h"
+
+// Small work-stealing thread pool for splitting loops over squares.
+// Every worker owns a double-ended queue; it pops its own work from the
+// back and steals from the front of the others when it runs dry. The
+// thread calling parallel_for() helps out instead of blocking. Several
+// threads may call parallel_for() at once (the simulation and the
+// renderer share one pool); a caller waiting on its own loop may help
+// with another's chunks in the meantime.
+class JobSystem
+{
+private:
+    struct Task {
+	void (*run)(void* context, std::size_t chunk, std::size_t begin, std::size_t end);
+	void* context;
+	std::size_t chunk;
+	std::size_t begin;
+	std::size_t end;
+	std::atomic<std::size_t>* remaining;
+    };
+
+    // Tasks in [head, tasks.size()) are queued. The owner takes from
+    // the back, thieves from head. Emptying resets both ends so the
+    // vector's capacity is reused and steady-state frames never
+    // allocate.
+    struct alignas(gCacheLineSize) Queue {
+	std::mutex mutex;
+	std::vector<Task> tasks;
+	std::size_t head {0};
+
+	bool empty() const { return head == tasks.size(); }
+	void reset_if_empty() {
+	    if (empty()) {
+		tasks.clear();
+		head = 0;
+	    }
+	}
+    };
+
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread> m_workers;
+    std::mutex m_sleep_mutex;
+    std::condition_variable m_wake;
+    std::atomic<std::size_t> m_queued {0};
+    std::atomic<bool> m_stop {false};
+
+    bool pop(std::size_t queue, Task& task) {
+	Queue& q = *m_queues[queue];
+	std::lock_guard<std::mutex> lock(q.mutex);
+	if (q.empty()) {
+	    return false;
+	}
+	task = q.tasks.back();
+	q.tasks.pop_back();
+	q.reset_if_empty();
+	m_queued.fetch_sub(1, std::memory_order_relaxed);
+	return true;
+    }
+
+    bool steal(std::size_t thief, Task& task) {
+	for (std::size_t n = 1; n <= m_queues.size(); ++n) {
+	    Queue& q = *m_queues[(thief + n) % m_queues.size()];
+	    std::lock_guard<std::mutex> lock(q.mutex);
+	    if (!q.empty()) {
+		task = q.tasks[q.head++];
+		q.reset_if_empty();
+		m_queued.fetch_sub(1, std::memory_order_relaxed);
+		return true;
+	    }
+	}
+	return false;
+    }
+
+    static void execute(const Task& task) {
+	task.run(task.context, task.chunk, task.begin, task.end);
+	task.remaining->fetch_sub(1, std::memory_order_release);
+    }
+
+    void worker_loop(std::size_t index) {
+	Task task {};
+	while (!m_stop.load(std::memory_order_relaxed)) {
+	    if (pop(index, task) || steal(index, task)) {
+		execute(task);
+		continue;
+	    }
+	    std::unique_lock<std::mutex> lock(m_sleep_mutex);
+	    m_wake.wait(lock, [this] {
+		return m_stop.load(std::memory_order_relaxed)
+		    || m_queued.load(std::memory_order_relaxed) > 0;
+	    });
+	}
+    }
+
+public:
+    // Loops with fewer items than this run inline on the caller
+    static constexpr std::size_t kMinParallelCount {4096};
+    // Chunks are a multiple of this many items so that, with cache line
+    // aligned arrays, no two chunks write to the same cache line
+    static constexpr std::size_t kChunkAlign {gCacheLineSize / sizeof(Color)};
+
+    explicit JobSystem(unsigned threads = std::thread::hardware_concurrency()) {
+	// The calling thread counts as one of the threads
+	unsigned workers = threads > 1 ? threads - 1 : 0;
+	for (unsigned i = 0; i < workers; ++i) {
+	    m_queues.push_back(std::make_unique<Queue>());
+	}
+	for (unsigned i = 0; i < workers; ++i) {
+	    m_workers.emplace_back([this, i] { worker_loop(i); });
+	}
+    }
+
+    ~JobSystem() {
+	{
+	    std::lock_guard<std::mutex> lock(m_sleep_mutex);
+	    m_stop = true;
+	}
+	m_wake.notify_all();
+	for (auto& worker : m_workers) {
+	    worker.join();
+	}
+    }
+
+    JobSystem(const JobSystem&) = delete;
+    JobSystem& operator=(const JobSystem&) = delete;
+
+    std::size_t threadCount() const { return m_workers.size() + 1; }
+
+    // Chunk size to split count items into: a few chunks per thread so
+    // stealing can even out the load, rounded up to kChunkAlign.
+    std::size_t chunkSize(std::size_t count) const {
+	if (count < kMinParallelCount || m_workers.empty()) {
+	    return std::max<std::size_t>(count, 1);
+	}
+	std::size_t chunk = count / (threadCount() * 4);
+	chunk = std::max(chunk, kMinParallelCount / 4);
+	return (chunk + kChunkAlign - 1) / kChunkAlign * kChunkAlign;
+    }
+
+    static std::size_t chunkCount(std::size_t count, std::size_t chunk) {
+	return (count + chunk - 1) / chunk;
+    }
+
+    // Call fn(chunk_index, begin, end) for every chunk of [0, count) and
+    // wait for all of them to finish.
+    template <typename Fn>
+    void parallel_for(std::size_t count, std::size_t chunk, Fn&& fn) {
+	std::size_t chunks = chunkCount(count, chunk);
+	if (chunks <= 1 || m_workers.empty()) {
+	    for (std::size_t c = 0; c < chunks; ++c) {
+		fn(c, c * chunk, std::min(count, (c + 1) * chunk));
+	    }
+	    return;
+	}
+
+	using Body = std::remove_reference_t<Fn>;
+	std::atomic<std::size_t> remaining {chunks};
+	auto run = [](void* context, std::size_t c, std::size_t begin, std::size_t end) {
+	    (*static_cast<Body*>(context))(c, begin, end);
+	};
+	{
+	    std::lock_guard<std::mutex> lock(m_sleep_mutex);
+	    m_queued.fetch_add(chunks, std::memory_order_relaxed);
+	}
+	// Deal chunks out round robin so each worker starts with a
+	// contiguous-ish share
+	for (std::size_t c = 0; c < chunks; ++c) {
+	    Queue& q = *m_queues[c % m_queues.size()];
+	    std::lock_guard<std::mutex> lock(q.mutex);
+	    q.tasks.push_back({run, const_cast<void*>(static_cast<const void*>(&fn)),
+			       c, c * chunk, std::min(count, (c + 1) * chunk),
+			       &remaining});
+	}
+	m_wake.notify_all();
+
+	Task task {};
+	while (remaining.load(std::memory_order_acquire) > 0) {
+	    if (steal(0, task)) {
+		execute(task);
+	    } else {
+		std::this_thread::yield();
+	    }
+	}
+    }
+};
+
+#endif // JOB_SYSTEM_H
@@ -0,0 +1,182 @@
+#ifndef RENDER_BATCH_H
+#define RENDER_BATCH_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "SDL2/SDL.h"
+
+#include "square-store.h"
+
+inline Uint32 color_key(Color color)
+{
+    return (static_cast<Uint32>(color.red) << 24)
+	| (static_cast<Uint32>(color.green) << 16)
+	| (static_cast<Uint32>(color.blue) << 8)
+	| static_cast<Uint32>(color.alpha);
+}
+
+// Collects rectangles into one bucket per color so a frame costs one
+// SDL_SetRenderDrawColor plus one SDL_RenderFillRects per color instead
+// of per square. Squares of different colors are no longer drawn in
+// index order, so overlaps can stack differently. All buffers are kept
+// between frames; clear() only resets sizes.
+class ColorRectBatch
+{
+private:
+    struct Bucket {
+	Color color;
+	std::vector<SDL_Rect> rects;
+    };
+
+    static constexpr Uint32 kEmpty {0xffffffff};
+
+    std::vector<Bucket> m_buckets;
+    std::size_t m_used {0};
+    // Open addressing color -> bucket table; kEmpty marks a free slot
+    std::vector<Uint32> m_slot_bucket;
+    std::vector<Uint32> m_slot_key;
+
+    static std::size_t hash(Uint32 key) {
+	return static_cast<std::size_t>(key * 0x9e3779b1u);
+    }
+
+    void grow_table() {
+	std::size_t capacity = m_slot_bucket.empty() ? 64 : m_slot_bucket.size() * 2;
+	m_slot_bucket.assign(capacity, kEmpty);
+	m_slot_key.assign(capacity, 0);
+	for (std::size_t b = 0; b < m_used; ++b) {
+	    insert_slot(color_key(m_buckets[b].color), static_cast<Uint32>(b));
+	}
+    }
+
+    void insert_slot(Uint32 key, Uint32 bucket) {
+	std::size_t mask = m_slot_bucket.size() - 1;
+	std::size_t slot = hash(key) & mask;
+	while (m_slot_bucket[slot] != kEmpty) {
+	    slot = (slot + 1) & mask;
+	}
+	m_slot_bucket[slot] = bucket;
+	m_slot_key[slot] = key;
+    }
+
+    Bucket& bucket_for(Color color) {
+	Uint32 key = color_key(color);
+	if (!m_slot_bucket.empty()) {
+	    std::size_t mask = m_slot_bucket.size() - 1;
+	    for (std::size_t slot = hash(key) & mask;
+		 m_slot_bucket[slot] != kEmpty;
+		 slot = (slot + 1) & mask) {
+		if (m_slot_key[slot] == key) {
+		    return m_buckets[m_slot_bucket[slot]];
+		}
+	    }
+	}
+	// New color this frame; keep the table at most half full
+	if ((m_used + 1) * 2 > m_slot_bucket.size()) {
+	    grow_table();
+	}
+	if (m_used == m_buckets.size()) {
+	    m_buckets.emplace_back();
+	}
+	Bucket& bucket = m_buckets[m_used];
+	bucket.color = color;
+	bucket.rects.clear();
+	insert_slot(key, static_cast<Uint32>(m_used));
+	++m_used;
+	return bucket;
+    }
+
+public:
+    void clear() {
+	for (std::size_t b = 0; b < m_used; ++b) {
+	    m_buckets[b].rects.clear();
+	}
+	m_used = 0;
+	std::fill(m_slot_bucket.begin(), m_slot_bucket.end(), kEmpty);
+    }
+
+    void add(Color color, const SDL_Rect& rect) {
+	bucket_for(color).rects.push_back(rect);
+    }
+
+    // Number of draw calls submit() will make
+    std::size_t bucketCount() const { return m_used; }
+
+    void submit(SDL_Renderer* renderer) const {
+	for (std::size_t b = 0; b < m_used; ++b) {
+	    const Bucket& bucket = m_buckets[b];
+	    SDL_SetRenderDrawColor(renderer,
+				   bucket.color.red,
+				   bucket.color.green,
+				   bucket.color.blue,
+				   bucket.color.alpha);
+	    SDL_RenderFillRects(renderer,
+				bucket.rects.data(),
+				static_cast<int>(bucket.rects.size()));
+	}
+    }
+};
+
+// Writes every square as two triangles with per-vertex color into one
+// vertex buffer so the whole frame is a single SDL_RenderGeometry call,
+// however many squares and colors there are. Unlike ColorRectBatch this
+// keeps index order. The index pattern only depends on the square count
+// so it is rebuilt only when the batch grows.
+class GeometryBatch
+{
+private:
+    std::vector<SDL_Vertex> m_vertices;
+    std::vector<int> m_indices;
+    std::size_t m_quads {0};
+
+    void grow_indices(std::size_t quads) {
+	std::size_t have = m_indices.size() / 6;
+	m_indices.reserve(quads * 6);
+	for (std::size_t q = have; q < quads; ++q) {
+	    int v = static_cast<int>(q * 4);
+	    m_indices.insert(m_indices.end(), {v, v + 1, v + 2, v + 2, v + 1, v + 3});
+	}
+    }
+
+public:
+    void clear() {
+	m_vertices.clear();
+	m_quads = 0;
+    }
+
+    void reserve(std::size_t quads) {
+	m_vertices.reserve(quads * 4);
+	grow_indices(quads);
+    }
+
+    void add(Color color, const SDL_Rect& rect) {
+	SDL_Color c {color.red, color.green, color.blue, color.alpha};
+	float x0 = static_cast<float>(rect.x);
+	float y0 = static_cast<float>(rect.y);
+	float x1 = static_cast<float>(rect.x + rect.w);
+	float y1 = static_cast<float>(rect.y + rect.h);
+	m_vertices.push_back({{x0, y0}, c, {0.0f, 0.0f}});
+	m_vertices.push_back({{x1, y0}, c, {0.0f, 0.0f}});
+	m_vertices.push_back({{x0, y1}, c, {0.0f, 0.0f}});
+	m_vertices.push_back({{x1, y1}, c, {0.0f, 0.0f}});
+	++m_quads;
+    }
+
+    void submit(SDL_Renderer* renderer) {
+	if (m_quads == 0) {
+	    return;
+	}
+	grow_indices(m_quads);
+	SDL_RenderGeometry(renderer,
+			   nullptr,
+			   m_vertices.data(),
+			   static_cast<int>(m_vertices.size()),
+			   m_indices.data(),
+			   static_cast<int>(m_quads * 6));
+    }
+};
+
+#endif // RENDER_BATCH_H
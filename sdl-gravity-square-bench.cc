@@ -0,0 +1,649 @@
+// Headless benchmark for the gravity squares simulation. Prints one
+// JSON object to stdout.
+//
+//   g++ -std=c++20 -O2 -pthread -o sdl-gravity-square-bench
+//       sdl-gravity-square-bench.cc $(sdl2-config --cflags --libs)
+//   ./sdl-gravity-square-bench --bodies 1000,10000 --frames 500 [--draw]
+//
+// Squares start out spread over the 640x480 screen on a grid rather
+// than all at its center, where the first steps would test every pair
+// against each other. They are 2 to 12 pixels across by default; the
+// game's 100x100 squares (--size 100) make even 10000 of them one solid
+// pile. The screen doesn't get bigger with the count, so past a few
+// ten thousand squares the pile and the sub-stepping of fast small
+// squares dominate; --broadphase none times the rest of the step on its
+// own at any count.
+//
+// For a pile-up scene, where squares of mixed sizes have settled on the
+// floor, use small varied sizes and a long warmup, e.g.
+//   --bodies 20000 --size 2,12 --warmup 600 --broadphase quadtree
+// and compare against --broadphase spatial-hash. Settled squares go to
+// sleep; --no-sleep keeps every square awake to see what that saves.
+//
+// Every frame is one physics step. --hz N sets the physics rate; the
+// world's constants are per second, so a higher rate simulates less
+// time per frame in finer steps.
+//
+// --draw also renders every frame through SDL's software renderer on
+// the dummy video driver, so no window or GPU is needed, one square at
+// a time unless --render picks batched (one call per color) or geometry
+// (one call per frame). --raster
+// renders with the built-in CPU rasterizer instead, without SDL at all;
+// with both, the rasterized frame is uploaded to a streaming texture and
+// copied by SDL the way the game does in its software mode. The
+// rasterizer runs tiled on every thread unless --serial-raster is given,
+// and only redraws tiles that changed unless --full-redraw is given.
+//
+// --capture DIR writes every drawn frame (warmup included) to DIR as a
+// PPM sequence, or PNG with --capture-png, on a background writer. It
+// implies --raster unless --draw is given. Frames the writer can't keep
+// up with are dropped rather than slowing the run, and are counted in
+// the output.
+//
+// --stream-fd N streams every drawn frame as raw RGBA to descriptor N,
+// also implying --raster without --draw:
+//   ./sdl-gravity-square-bench --bodies 10000 --frames 3600 --stream-fd 3
+//       3> >(ffmpeg -f rawvideo -pix_fmt rgba -s 640x480 -r 60 -i - out.mp4)
+// Drawing waits for the reader unless --stream-drop is given, in which
+// case frames it isn't ready for are dropped. Backpressure stats are in
+// the output.
+//
+// --verify checks instead of timing: it runs the same scene, steps and
+// seed once per SIMD level up to what the CPU has, in strict mode, and
+// compares every square bit for bit against the scalar run. With
+// --snapshot PATH it also runs the scene under other world constants,
+// saves it to PATH after the warmup and checks that loading it over a
+// default world carries on to the same squares. Exits with 1 if
+// anything differs.
+//
+// --snapshot PATH saves the world to PATH after the warmup and loads it
+// straight back before the timed frames, reporting how long both took.
+// The timed frames then run from the restored world and come out
+// exactly as they would have without it.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define GRAVITY_SQUARE_NO_MAIN
+#include "sdl-gravity-square.cc"
+
+struct BenchOptions {
+    std::vector<int> bodies {1000, 10000};
+    int frames {500};
+    double hz {gPhysicsHz};
+    int warmup {50};
+    bool draw {false};
+    RenderMode render {RenderMode::Immediate};
+    bool raster {false};
+    bool tiled_raster {true};
+    bool incremental {true};
+    std::string capture;
+    bool capture_png {false};
+    int stream_fd {-1};
+    bool stream_drop {false};
+    std::string snapshot;
+    bool verify {false};
+    bool sleep {true};
+    std::uint64_t seed {1};
+    Broadphase broadphase {gBroadphase};
+    int min_size {2};
+    int max_size {12};
+};
+
+const char* render_mode_name(RenderMode mode)
+{
+    switch (mode) {
+    case RenderMode::Batched:
+	return "batched";
+    case RenderMode::Geometry:
+	return "geometry";
+    case RenderMode::Software:
+	return "software";
+    case RenderMode::Immediate:
+	break;
+    }
+    return "immediate";
+}
+
+const char* broadphase_name(Broadphase broadphase)
+{
+    switch (broadphase) {
+    case Broadphase::SpatialHash:
+	return "spatial-hash";
+    case Broadphase::SweepAndPrune:
+	return "sweep-and-prune";
+    case Broadphase::AabbTree:
+	return "aabb-tree";
+    case Broadphase::Quadtree:
+	return "quadtree";
+    case Broadphase::None:
+	break;
+    }
+    return "none";
+}
+
+bool parse_broadphase(const std::string& name, Broadphase& broadphase)
+{
+    for (Broadphase b : {Broadphase::None,
+			 Broadphase::SpatialHash,
+			 Broadphase::SweepAndPrune,
+			 Broadphase::AabbTree,
+			 Broadphase::Quadtree}) {
+	if (name == broadphase_name(b)) {
+	    broadphase = b;
+	    return true;
+	}
+    }
+    return false;
+}
+
+struct BenchResult {
+    int bodies {0};
+    int frames {0};
+    double ns_per_body_step {0.0};
+    double fps {0.0};
+    double p50_ms {0.0};
+    double p90_ms {0.0};
+    double p99_ms {0.0};
+    double max_ms {0.0};
+    std::uint64_t heap_allocations {0};
+    // Squares still awake after the last frame
+    std::size_t awake {0};
+    // Squares sub-stepped in the last frame
+    std::size_t substepped {0};
+    // Share of tiles the tiled rasterizer redrew per frame
+    double redrawn {0.0};
+    // Saving and restoring the world after the warmup
+    bool snapshot_ok {false};
+    std::uint64_t snapshot_bytes {0};
+    double save_ms {0.0};
+    double load_ms {0.0};
+};
+
+void print_usage(const char* program)
+{
+    std::fprintf(stderr,
+		 "usage: %s [--bodies N[,N...]] [--frames N] [--warmup N]"
+		 " [--seed N] [--hz N]"
+		 " [--size MIN[,MAX]]"
+		 " [--broadphase none|spatial-hash|sweep-and-prune|aabb-tree|quadtree]"
+		 " [--no-sleep] [--draw [--render immediate|batched|geometry]]"
+		 " [--raster] [--serial-raster] [--full-redraw]"
+		 " [--capture DIR [--capture-png]] [--stream-fd N [--stream-drop]]"
+		 " [--snapshot PATH] [--verify]\n",
+		 program);
+}
+
+bool parse_options(int argc, char* argv[], BenchOptions& options)
+{
+    for (int i = 1; i < argc; ++i) {
+	std::string arg = argv[i];
+	bool has_value = i + 1 < argc;
+	if (arg == "--bodies" && has_value) {
+	    options.bodies.clear();
+	    std::string list = argv[++i];
+	    for (std::size_t start = 0; start <= list.size();) {
+		std::size_t comma = list.find(',', start);
+		if (comma == std::string::npos) {
+		    comma = list.size();
+		}
+		options.bodies.push_back(std::atoi(list.substr(start, comma - start).c_str()));
+		start = comma + 1;
+	    }
+	} else if (arg == "--frames" && has_value) {
+	    options.frames = std::atoi(argv[++i]);
+	} else if (arg == "--warmup" && has_value) {
+	    options.warmup = std::atoi(argv[++i]);
+	} else if (arg == "--hz" && has_value) {
+	    options.hz = std::atof(argv[++i]);
+	    if (options.hz <= 0.0) {
+		return false;
+	    }
+	} else if (arg == "--seed" && has_value) {
+	    options.seed = std::strtoull(argv[++i], nullptr, 10);
+	} else if (arg == "--size" && has_value) {
+	    std::string sizes = argv[++i];
+	    std::size_t comma = sizes.find(',');
+	    options.min_size = std::atoi(sizes.substr(0, comma).c_str());
+	    options.max_size = comma == std::string::npos
+		? options.min_size : std::atoi(sizes.substr(comma + 1).c_str());
+	    if (options.min_size <= 0 || options.max_size < options.min_size) {
+		return false;
+	    }
+	} else if (arg == "--broadphase" && has_value) {
+	    if (!parse_broadphase(argv[++i], options.broadphase)) {
+		return false;
+	    }
+	} else if (arg == "--no-sleep") {
+	    options.sleep = false;
+	} else if (arg == "--draw") {
+	    options.draw = true;
+	} else if (arg == "--render" && has_value) {
+	    std::string name = argv[++i];
+	    if (name == render_mode_name(RenderMode::Immediate)) {
+		options.render = RenderMode::Immediate;
+	    } else if (name == render_mode_name(RenderMode::Batched)) {
+		options.render = RenderMode::Batched;
+	    } else if (name == render_mode_name(RenderMode::Geometry)) {
+		options.render = RenderMode::Geometry;
+	    } else {
+		return false;
+	    }
+	} else if (arg == "--raster") {
+	    options.raster = true;
+	} else if (arg == "--serial-raster") {
+	    options.raster = true;
+	    options.tiled_raster = false;
+	} else if (arg == "--full-redraw") {
+	    options.raster = true;
+	    options.incremental = false;
+	} else if (arg == "--capture" && has_value) {
+	    options.capture = argv[++i];
+	} else if (arg == "--capture-png") {
+	    options.capture_png = true;
+	} else if (arg == "--stream-fd" && has_value) {
+	    options.stream_fd = std::atoi(argv[++i]);
+	} else if (arg == "--stream-drop") {
+	    options.stream_drop = true;
+	} else if (arg == "--snapshot" && has_value) {
+	    options.snapshot = argv[++i];
+	} else if (arg == "--verify") {
+	    options.verify = true;
+	} else {
+	    return false;
+	}
+    }
+    if ((!options.capture.empty() || options.stream_fd >= 0) && !options.draw) {
+	options.raster = true;
+    }
+    return options.frames > 0;
+}
+
+// Software renderer on the dummy video driver
+int init_headless(void) {
+    SDL_SetHint(SDL_HINT_VIDEODRIVER, "dummy");
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+	SDL_Log("SDL_Init Error: %s\n", SDL_GetError());
+	return 0;
+    }
+    gWindow = SDL_CreateWindow("Gravity Square Bench",
+			       SDL_WINDOWPOS_UNDEFINED,
+			       SDL_WINDOWPOS_UNDEFINED,
+			       gScreenWidth,
+			       gScreenHeight,
+			       SDL_WINDOW_HIDDEN);
+    if (gWindow == nullptr) {
+	SDL_Log("SDL_CreateWindow Error: %s\n", SDL_GetError());
+	return 0;
+    }
+    gRenderer = SDL_CreateRenderer(gWindow, -1, SDL_RENDERER_SOFTWARE);
+    if (gRenderer == nullptr) {
+	SDL_Log("SDL_CreateRenderer Error: %s\n", SDL_GetError());
+	return 0;
+    }
+    gFramebufferTexture = SDL_CreateTexture(gRenderer,
+					    gFramebufferFormat,
+					    SDL_TEXTUREACCESS_STREAMING,
+					    gScreenWidth,
+					    gScreenHeight);
+    return 1;
+}
+
+// Lay the squares out on a grid covering the screen, row by row, and
+// make that where they were last step too
+void spread_squares(void) {
+    const std::size_t n = gSquares.size();
+    if (n == 0) {
+	return;
+    }
+    const double aspect = static_cast<double>(gScreenWidth) / gScreenHeight;
+    const std::size_t cols = std::max<std::size_t>(
+	1, static_cast<std::size_t>(std::ceil(std::sqrt(n * aspect))));
+    const std::size_t rows = (n + cols - 1) / cols;
+    const double cell_w = static_cast<double>(gScreenWidth) / cols;
+    const double cell_h = static_cast<double>(gScreenHeight) / rows;
+    for (std::size_t i = 0; i < n; ++i) {
+	gSquares.pos_x[i] = std::min((i % cols) * cell_w, gScreenWidth - gSquares.size_x[i]);
+	gSquares.pos_y[i] = std::min((i / cols) * cell_h, gScreenHeight - gSquares.size_y[i]);
+    }
+    save_previous_positions();
+}
+
+// Publish and draw the step just taken, the way the two threads of the
+// real program hand it over, but one after the other
+void draw_frame(const BenchOptions& options) {
+    publish_snapshot();
+    gSnapshots.update();
+    if (options.draw) {
+	draw_squares(gSnapshots.front(), 1.0);
+    } else {
+	raster_squares(gSnapshots.front(), 1.0);
+	capture_frame(true);
+    }
+}
+
+double percentile(const std::vector<double>& sorted, double p)
+{
+    std::size_t i = static_cast<std::size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+BenchResult run_bench(int bodies, const BenchOptions& options)
+{
+    using Clock = std::chrono::steady_clock;
+
+    seed_random(options.seed);
+    gBroadphase = options.broadphase;
+    gSleep.enabled = options.sleep;
+    gMinSquareSize = options.min_size;
+    gMaxSquareSize = options.max_size;
+    gNumSquares = bodies;
+    reinit_squares();
+    spread_squares();
+    for (int i = 0; i < options.warmup; ++i) {
+	save_previous_positions();
+	update_squares();
+	if (options.draw || options.raster) {
+	    draw_frame(options);
+	}
+    }
+
+    BenchResult result;
+    if (!options.snapshot.empty()) {
+	auto start = Clock::now();
+	result.snapshot_ok = save_world(options.snapshot.c_str());
+	auto saved = Clock::now();
+	result.snapshot_ok = result.snapshot_ok && load_world(options.snapshot.c_str());
+	auto loaded = Clock::now();
+	result.save_ms = std::chrono::duration<double, std::milli>(saved - start).count();
+	result.load_ms = std::chrono::duration<double, std::milli>(loaded - saved).count();
+	struct stat info {};
+	if (::stat(options.snapshot.c_str(), &info) == 0) {
+	    result.snapshot_bytes = static_cast<std::uint64_t>(info.st_size);
+	}
+    }
+
+    std::vector<double> frame_ns;
+    frame_ns.reserve(options.frames);
+    std::uint64_t allocations = heap_allocation_count();
+    double update_ns = 0.0;
+    std::size_t redrawn_tiles = 0;
+    for (int i = 0; i < options.frames; ++i) {
+	auto start = Clock::now();
+	save_previous_positions();
+	update_squares();
+	auto updated = Clock::now();
+	if (options.draw || options.raster) {
+	    draw_frame(options);
+	}
+	auto end = Clock::now();
+	redrawn_tiles += gTileRasterizer.redrawnCount();
+	update_ns += std::chrono::duration<double, std::nano>(updated - start).count();
+	frame_ns.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+    }
+
+    result.bodies = bodies;
+    result.frames = options.frames;
+    result.heap_allocations = heap_allocation_count() - allocations;
+    result.awake = gSleep.awakeCount();
+    result.substepped = gSubsteps.fastCount();
+    if (options.raster && options.tiled_raster) {
+	result.redrawn = static_cast<double>(redrawn_tiles)
+	    / (static_cast<double>(gTileRasterizer.tileCount()) * options.frames);
+    }
+    result.ns_per_body_step = bodies > 0 ? update_ns / (static_cast<double>(bodies) * options.frames) : 0.0;
+    double total_ns = 0.0;
+    for (double ns : frame_ns) {
+	total_ns += ns;
+    }
+    result.fps = total_ns > 0.0 ? options.frames * 1e9 / total_ns : 0.0;
+    std::sort(frame_ns.begin(), frame_ns.end());
+    result.p50_ms = percentile(frame_ns, 0.50) / 1e6;
+    result.p90_ms = percentile(frame_ns, 0.90) / 1e6;
+    result.p99_ms = percentile(frame_ns, 0.99) / 1e6;
+    result.max_ms = frame_ns.back() / 1e6;
+    return result;
+}
+
+// Run warmup + frames strict steps of the bench scene with the kernels
+// capped at level and return the squares they end with
+SquareStore run_strict(int bodies, const BenchOptions& options, SimdLevel level)
+{
+    seed_random(options.seed);
+    gBroadphase = options.broadphase;
+    gSleep.enabled = options.sleep;
+    gMinSquareSize = options.min_size;
+    gMaxSquareSize = options.max_size;
+    gNumSquares = bodies;
+    gIntegrateMode = IntegrateMode::Strict;
+    gMaxSimdLevel = level;
+    reinit_squares();
+    spread_squares();
+    for (int i = 0; i < options.warmup + options.frames; ++i) {
+	save_previous_positions();
+	update_squares();
+    }
+    return gSquares;
+}
+
+template <typename T>
+bool same_bits(const AlignedVector<T>& a, const AlignedVector<T>& b)
+{
+    return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0;
+}
+
+bool same_squares(const SquareStore& a, const SquareStore& b)
+{
+    return same_bits(a.pos_x, b.pos_x) && same_bits(a.pos_y, b.pos_y)
+	&& same_bits(a.vel_x, b.vel_x) && same_bits(a.vel_y, b.vel_y)
+	&& same_bits(a.size_x, b.size_x) && same_bits(a.size_y, b.size_y)
+	&& same_bits(a.color, b.color);
+}
+
+// A loaded world has to step on exactly as the saved one, constants
+// included: run the scene strict under other constants, save it after
+// the warmup and finish the run, then load it over a default world and
+// finish again
+bool verify_snapshot(int bodies, const BenchOptions& options)
+{
+    const World defaults = gWorld;
+    gWorld.gravity = defaults.gravity * 0.5;
+    gWorld.damping = defaults.damping * 0.5;
+    gWorld.air_resistance = defaults.air_resistance * 0.5;
+    gWorld.restitution = defaults.restitution * 0.5;
+    gWorld.rest_speed = defaults.rest_speed * 0.5;
+    gWorld.ground_friction = defaults.ground_friction * 0.5;
+    update_step_constants();
+    seed_random(options.seed);
+    gBroadphase = options.broadphase;
+    gSleep.enabled = options.sleep;
+    gMinSquareSize = options.min_size;
+    gMaxSquareSize = options.max_size;
+    gNumSquares = bodies;
+    gIntegrateMode = IntegrateMode::Strict;
+    gMaxSimdLevel = detect_simd_level();
+    reinit_squares();
+    spread_squares();
+    for (int i = 0; i < options.warmup; ++i) {
+	save_previous_positions();
+	update_squares();
+    }
+    bool same = save_world(options.snapshot.c_str());
+    for (int i = 0; i < options.frames; ++i) {
+	save_previous_positions();
+	update_squares();
+    }
+    const SquareStore saved = gSquares;
+
+    gWorld = defaults;
+    update_step_constants();
+    reinit_squares();
+    same = same && load_world(options.snapshot.c_str());
+    for (int i = 0; same && i < options.frames; ++i) {
+	save_previous_positions();
+	update_squares();
+    }
+    same = same && same_squares(saved, gSquares);
+    gWorld = defaults;
+    update_step_constants();
+    return same;
+}
+
+// Strict mode has to come out the same at every SIMD level. Prints one
+// JSON object and returns whether it did.
+bool verify_strict(const BenchOptions& options)
+{
+    bool identical = true;
+    std::printf("{\n");
+    std::printf("  \"simd\": \"%s\",\n", simd_level_name(detect_simd_level()));
+    std::printf("  \"broadphase\": \"%s\",\n", broadphase_name(options.broadphase));
+    std::printf("  \"steps\": %d,\n", options.warmup + options.frames);
+    std::printf("  \"seed\": %llu,\n", static_cast<unsigned long long>(options.seed));
+    std::printf("  \"verify\": [\n");
+    bool first = true;
+    for (int bodies : options.bodies) {
+	const SquareStore scalar = run_strict(bodies, options, SimdLevel::Scalar);
+	for (SimdLevel level : {SimdLevel::SSE2, SimdLevel::AVX2}) {
+	    if (level > detect_simd_level()) {
+		continue;
+	    }
+	    const bool same = same_squares(scalar, run_strict(bodies, options, level));
+	    identical = identical && same;
+	    std::printf("%s    {\"bodies\": %d, \"simd\": \"%s\", \"identical\": %s}",
+			first ? "" : ",\n", bodies, simd_level_name(level), same ? "true" : "false");
+	    first = false;
+	}
+    }
+    std::printf("\n  ]");
+    if (!options.snapshot.empty()) {
+	std::printf(",\n  \"snapshot\": [\n");
+	first = true;
+	for (int bodies : options.bodies) {
+	    const bool same = verify_snapshot(bodies, options);
+	    identical = identical && same;
+	    std::printf("%s    {\"bodies\": %d, \"identical\": %s}",
+			first ? "" : ",\n", bodies, same ? "true" : "false");
+	    first = false;
+	}
+	std::printf("\n  ]");
+    }
+    std::printf("\n}\n");
+    return identical;
+}
+
+void print_json(const BenchOptions& options, const std::vector<BenchResult>& results)
+{
+    std::printf("{\n");
+    std::printf("  \"simd\": \"%s\",\n", simd_level_name(detect_simd_level()));
+    std::printf("  \"threads\": %zu,\n", gJobs.threadCount());
+    std::printf("  \"hz\": %g,\n", options.hz);
+    std::printf("  \"broadphase\": \"%s\",\n", broadphase_name(options.broadphase));
+    std::printf("  \"size\": [%d, %d],\n", options.min_size, options.max_size);
+    std::printf("  \"sleep\": %s,\n", options.sleep ? "true" : "false");
+    if (options.draw && !options.raster) {
+	std::printf("  \"draw\": \"%s\",\n", render_mode_name(options.render));
+    } else {
+	std::printf("  \"draw\": %s,\n", options.draw ? "true" : "false");
+    }
+    std::printf("  \"raster\": %s,\n",
+		!options.raster ? "false" : options.tiled_raster ? "\"tiled\"" : "\"serial\"");
+    std::printf("  \"seed\": %llu,\n", static_cast<unsigned long long>(options.seed));
+    if (!options.capture.empty()) {
+	std::printf("  \"capture\": {\"frames\": %llu, \"written\": %llu, "
+		    "\"dropped\": %llu, \"failed\": %llu},\n",
+		    static_cast<unsigned long long>(gCapture.frameCount()),
+		    static_cast<unsigned long long>(gCapture.writtenCount()),
+		    static_cast<unsigned long long>(gCapture.droppedCount()),
+		    static_cast<unsigned long long>(gCapture.failedCount()));
+    }
+    if (options.stream_fd >= 0) {
+	std::printf("  \"stream\": {\"frames\": %llu, \"written\": %llu, \"dropped\": %llu, "
+		    "\"bytes\": %llu, \"writes\": %llu, \"short_writes\": %llu, "
+		    "\"blocked\": %llu, \"blocked_s\": %.4f, \"max_blocked_ms\": %.3f, "
+		    "\"broken\": %s},\n",
+		    static_cast<unsigned long long>(gStream.frameCount()),
+		    static_cast<unsigned long long>(gStream.writtenCount()),
+		    static_cast<unsigned long long>(gStream.droppedCount()),
+		    static_cast<unsigned long long>(gStream.bytesWritten()),
+		    static_cast<unsigned long long>(gStream.writeCalls()),
+		    static_cast<unsigned long long>(gStream.shortWrites()),
+		    static_cast<unsigned long long>(gStream.blockedCount()),
+		    gStream.blockedSeconds(),
+		    gStream.maxBlockedSeconds() * 1000.0,
+		    gStream.broken() ? "true" : "false");
+    }
+    std::printf("  \"runs\": [\n");
+    for (std::size_t i = 0; i < results.size(); ++i) {
+	const BenchResult& r = results[i];
+	std::printf("    {\"bodies\": %d, \"frames\": %d, \"ns_per_body_step\": %.4f, "
+		    "\"fps\": %.2f, \"frame_ms\": {\"p50\": %.4f, \"p90\": %.4f, "
+		    "\"p99\": %.4f, \"max\": %.4f}, \"heap_allocations\": %llu, "
+		    "\"awake\": %zu, \"substepped\": %zu, \"redrawn\": %.3f",
+		    r.bodies, r.frames, r.ns_per_body_step, r.fps,
+		    r.p50_ms, r.p90_ms, r.p99_ms, r.max_ms,
+		    static_cast<unsigned long long>(r.heap_allocations), r.awake, r.substepped, r.redrawn);
+	if (!options.snapshot.empty()) {
+	    std::printf(", \"snapshot\": {\"ok\": %s, \"bytes\": %llu, "
+			"\"save_ms\": %.3f, \"load_ms\": %.3f}",
+			r.snapshot_ok ? "true" : "false",
+			static_cast<unsigned long long>(r.snapshot_bytes), r.save_ms, r.load_ms);
+	}
+	std::printf("}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    std::printf("  ]\n");
+    std::printf("}\n");
+}
+
+int main(int argc, char* argv[])
+{
+    BenchOptions options;
+    if (!parse_options(argc, argv, options)) {
+	print_usage(argv[0]);
+	return 2;
+    }
+    set_physics_hz(options.hz);
+    if (options.verify) {
+	return verify_strict(options) ? 0 : 1;
+    }
+    if (options.draw && !init_headless()) {
+	return 1;
+    }
+    gRenderMode = options.render;
+    if (options.raster) {
+	gRenderMode = RenderMode::Software;
+	gTiledRaster = options.tiled_raster;
+	gTileRasterizer.incremental = options.incremental;
+    }
+
+    if (!options.capture.empty()
+	&& !gCapture.start(options.capture,
+			   options.capture_png ? FrameCapture::Format::Png : FrameCapture::Format::Ppm,
+			   gScreenWidth, gScreenHeight)) {
+	std::fprintf(stderr, "can't capture to %s\n", options.capture.c_str());
+	return 1;
+    }
+
+    if (options.stream_fd >= 0) {
+	gStream.policy = options.stream_drop ? FrameStream::Policy::Drop : FrameStream::Policy::Block;
+	gStream.start(options.stream_fd, gScreenWidth, gScreenHeight);
+    }
+
+    std::vector<BenchResult> results;
+    for (int bodies : options.bodies) {
+	results.push_back(run_bench(bodies, options));
+    }
+    // Let the writers finish before reporting what they wrote
+    gCapture.stop();
+    gStream.stop();
+    print_json(options, results);
+
+    if (options.draw) {
+	close();
+    }
+    return 0;
+}
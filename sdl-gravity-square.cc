@@ -1,121 +1,76 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
-#include <random>
+#include <thread>
+#include <vector>
 
 #include "SDL2/SDL.h"
 
-struct Vec2 {
-    double x {0.0};
-    double y {0.0};
-
-    Vec2() = default;
-    Vec2(double x_val, double y_val)
-	: x {x_val}
-	, y {y_val} {}
-    Vec2 operator+(const Vec2& other) const {
-	return Vec2(x + other.x, y + other.y);
-    }
-    // TODO: Add more methods
-};
-
-struct Color {
-    // Default to white
-    Uint8 red {0xff};
-    Uint8 green {0xff};
-    Uint8 blue {0xff};
-    Uint8 alpha {0xff};
-    Color() = default;
-    Color(Uint8 r, Uint8 g, Uint8 b, Uint8 a)
-	: red {r}
-	, green {g}
-	, blue {b}
-	, alpha(a) {}
-    Color(Uint8 r, Uint8 g, Uint8 b)
-	: Color(r, g, b, 0xff) {}
-};
-
-class Square
-{
-private:
-    Vec2 m_size {10.0, 10.0};
-    Vec2 m_position {0.0, 0.0};
-    Vec2 m_velocity {};
-    Color m_color {};
-
-public:
-    Square() = default;
-    Square(Vec2 size, Vec2 pos, Vec2 v)
-	: m_size {size}
-	, m_position {pos}
-	, m_velocity {v} {}
-    Square(Vec2 size)
-	: m_size {size} {}
-    Vec2 size() const { return m_size; }
-    void setSize(Vec2 size) { m_size = size; }
-    Vec2 position() const { return m_position; }
-    void setPos(Vec2 pos) { m_position = pos; }
-    void setPosX(double x) { m_position.x = x; }
-    void setPosY(double y) { m_position.y = y; }
-    Vec2 velocity() const { return m_velocity; }
-    void setVelocity(Vec2 velocity) { m_velocity = velocity; }
-    Color color() const { return m_color; }
-    void setColor(Color color) { m_color = color; }
-
-    void applyGravity(double gravity)
-    {
-	m_velocity.y += gravity;
-    }
-
-    void applyAirResistance(double air_resistance)
-    {
-	m_velocity.x *= air_resistance;
-    }
-
-    void dampX(double damping) {
-	m_velocity.x *= -damping;
-    }
-
-    void dampY(double damping) {
-	m_velocity.y *= -damping;
-    }
-
-    void updatePosition()
-    {
-	m_position.x += m_velocity.x;
-	m_position.y += m_velocity.y;
-    }
-};
+#include "alloc-counter.h"
+#include "broadphase-grid.h"
+#include "broadphase-quadtree.h"
+#include "broadphase-sap.h"
+#include "broadphase-tree.h"
+#include "fast-random.h"
+#include "fixed-timestep.h"
+#include "frame-capture.h"
+#include "frame-stream.h"
+#include "job-system.h"
+#include "render-batch.h"
+#include "software-raster.h"
+#include "square-bounds.h"
+#include "square-collide.h"
+#include "square-simd.h"
+#include "square-sleep.h"
+#include "square-store.h"
+#include "spsc-queue.h"
+#include "square-substep.h"
+#include "triple-buffer.h"
+#include "world-snapshot.h"
 
+// Physics constants, in seconds so that the physics rate only changes
+// how finely the motion is sampled and not how fast it plays. The step
+// itself works in pixels per step; per_step() converts.
 struct World {
-    double gravity {0.5};
+    // Pixels per second squared
+    double gravity {1800.0};
+    // Share of speed kept by a bounce off a wall
     double damping {0.9};
-    double air_resistance {0.995};
+    // Share of horizontal speed kept after a second
+    double air_resistance {0.7401};
+    // Bounciness of square-vs-square collisions
+    double restitution {0.9};
+    // Squares landing slower than this, in pixels per second, stay on
+    // the floor
+    double rest_speed {30.0};
+    // Share of horizontal speed kept after a second sliding on the floor
+    double ground_friction {0.046};
     World() = default;
     World(double g, double d, double ar)
 	: gravity {g}, damping {d}, air_resistance {ar} {}
+
+    // The same constants for one step of step_seconds
+    World per_step(double step_seconds) const {
+	World step = *this;
+	step.gravity = gravity * step_seconds * step_seconds;
+	step.air_resistance = std::pow(air_resistance, step_seconds);
+	step.rest_speed = rest_speed * step_seconds;
+	step.ground_friction = std::pow(ground_friction, step_seconds);
+	return step;
+    }
 };
 
 int get_random_int(int low, int high)
 {
-    // Setup random number generator for low to high
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    std::uniform_int_distribution<> distrib(low, high);
-    return distrib(gen);
+    return thread_random().generator.range(low, high);
 }
 
 Color get_random_color(void)
 {
-    Color color {};
-    color.red = get_random_int(0, 255);
-    color.green = get_random_int(0, 255);
-    color.blue = get_random_int(0, 255);
-    return color;
-}
-
-Vec2 get_random_velocity(void)
-{
-    return Vec2 {static_cast<double>(get_random_int(-20, 20)),
-		 static_cast<double>(get_random_int(-20, 20))};
+    return thread_random().generator.color();
 }
 
 void set_color(SDL_Renderer* renderer, Color color)
@@ -131,11 +86,179 @@ constexpr int gScreenWidth {640};
 constexpr int gScreenHeight {480};
 SDL_Window *gWindow = nullptr;
 SDL_Renderer *gRenderer = nullptr;
-Square *gSquare;
-std::vector<Square*> gSquares;
-constexpr int gNumSquares = 4;
+SquareStore gSingleSquare;
+Square gSquare;
+SquareStore gSquares;
+// Not constexpr so the benchmark can change it
+int gNumSquares = 4;
+// Squares get a random size in this range
+int gMinSquareSize = 100;
+int gMaxSquareSize = 100;
+// Non-zero replays the same run every time
+constexpr std::uint64_t gRandomSeed {0};
 World gWorld;
 Color gBackgroundColor;
+IntegrateMode gIntegrateMode {IntegrateMode::Strict};
+SimdLevel gMaxSimdLevel {SimdLevel::AVX2};
+JobSystem gJobs;
+// Squares that bounced this update, one list per job chunk, reused
+// across frames
+std::vector<std::vector<std::size_t>> gBounced;
+
+enum class Broadphase {
+    // Squares pass through each other
+    None,
+    SpatialHash,
+    SweepAndPrune,
+    AabbTree,
+    Quadtree,
+};
+Broadphase gBroadphase {Broadphase::SpatialHash};
+SpatialHashGrid gGrid;
+SweepAndPrune gSweep;
+// Also used for mouse picking whatever the broadphase
+DynamicAabbTree gTree;
+LooseQuadtree gQuadtree {0.0, 0.0, gScreenWidth, gScreenHeight};
+// Candidate square-vs-square pairs, reused across frames
+std::vector<CollisionPair> gPairs;
+// Squares at rest are skipped until something hits them
+SleepSystem gSleep;
+// Squares too fast for one step are split into several
+SubStepper gSubsteps;
+// Default physics rate, --hz changes it
+constexpr double gPhysicsHz {60.0};
+constexpr int gMaxStepsPerFrame {5};
+FixedTimestep gTimestep {gPhysicsHz, gMaxStepsPerFrame};
+// gWorld for one step at the current rate
+World gStepWorld {gWorld.per_step(gTimestep.step_seconds)};
+// Squares start out this fast on each axis at most, and a click
+// launches one at this speed, in pixels per second
+constexpr int gMaxStartSpeed {1200};
+constexpr double gClickSpeed {1200.0};
+// Squares moving slower than this, in pixels per second, for this many
+// seconds go to sleep
+constexpr double gSleepSpeed {60.0};
+constexpr double gSleepSeconds {0.5};
+// Positions before the last physics step, for render interpolation
+AlignedVector<double> gPrevPosX;
+AlignedVector<double> gPrevPosY;
+
+// Bring everything measured per step in line with gWorld and the rate
+void update_step_constants(void)
+{
+    const double dt = gTimestep.step_seconds;
+    gStepWorld = gWorld.per_step(dt);
+    gSleep.sleep_speed = gSleepSpeed * dt;
+    gSleep.frames_to_sleep = std::max(1, static_cast<int>(std::lround(gSleepSeconds / dt)));
+}
+
+void set_physics_hz(double hz)
+{
+    gTimestep.step_seconds = 1.0 / hz;
+    update_step_constants();
+}
+
+// Random start velocity, in pixels per step
+Vec2 get_random_velocity(void)
+{
+    const double dt = gTimestep.step_seconds;
+    return Vec2 {get_random_int(-gMaxStartSpeed, gMaxStartSpeed) * dt,
+		 get_random_int(-gMaxStartSpeed, gMaxStartSpeed) * dt};
+}
+
+enum class RenderMode {
+    // One color change and fill call per square
+    Immediate,
+    // One fill call per distinct color. Faster, but overlapping squares
+    // of different colors no longer stack in index order, so it is
+    // opt-in (B)
+    Batched,
+    // One geometry call per frame with per-vertex color
+    Geometry,
+    // Drawn on the CPU into gFramebuffer, then one texture copy
+    Software,
+};
+// Draws squares in index order, later ones on top; B cycles through the
+// other modes
+RenderMode gRenderMode {RenderMode::Immediate};
+ColorRectBatch gRectBatch;
+GeometryBatch gGeometryBatch;
+Framebuffer gFramebuffer {gScreenWidth, gScreenHeight};
+// Rasterize on all of gJobs' threads rather than just the render thread
+bool gTiledRaster {true};
+TileRasterizer gTileRasterizer;
+// Streaming texture gFramebuffer is uploaded to
+SDL_Texture *gFramebufferTexture = nullptr;
+// Frames written to image files while capturing
+FrameCapture gCapture;
+constexpr const char* gCaptureDirectory {"capture"};
+// F5 saves the world here and F9 restores it
+constexpr const char* gSnapshotPath {"world.snapshot"};
+// Raw RGBA frames to a descriptor, for piping into a video encoder
+FrameStream gStream;
+// Frames (after the first with a physics step) that allocated from the
+// heap
+Uint64 gFrames {0};
+Uint64 gAllocatingFrames {0};
+
+// What the render thread needs from one physics step, copied out so
+// the simulation can carry on while it is drawn
+struct Snapshot {
+    AlignedVector<double> prev_x;
+    AlignedVector<double> prev_y;
+    AlignedVector<double> pos_x;
+    AlignedVector<double> pos_y;
+    AlignedVector<double> size_x;
+    AlignedVector<double> size_y;
+    AlignedVector<Color> color;
+    // Physics steps run so far
+    std::uint64_t step {0};
+    // Performance counter when it was published
+    Uint64 counter {0};
+
+    std::size_t size() const { return pos_x.size(); }
+    void reserve(std::size_t n) {
+	for (AlignedVector<double>* v : {&prev_x, &prev_y, &pos_x, &pos_y, &size_x, &size_y}) {
+	    v->reserve(n);
+	}
+	color.reserve(n);
+    }
+};
+TripleBuffer<Snapshot> gSnapshots;
+
+// Input for the simulation thread. The render thread stamps each one
+// with the performance counter when it read the event, and the
+// simulation runs it just before the first step that starts after it.
+struct Command {
+    enum class Type {
+	Reset,
+	NextBroadphase,
+	ToggleSleep,
+	// New square centered on x, y
+	Spawn,
+	// Add force to the velocity of the square under x, y
+	ApplyForce,
+	SaveSnapshot,
+	LoadSnapshot,
+    };
+    Type type;
+    Uint64 timestamp {0};
+    int x {0};
+    int y {0};
+    // Pixels per second
+    double force_x {0.0};
+    double force_y {0.0};
+};
+SpscQueue<Command, 256> gCommands;
+// Commands thrown away because the queue was full, on the render thread
+Uint64 gDroppedCommands {0};
+// Time from event to simulation, on the simulation thread
+Uint64 gCommandCount {0};
+Uint64 gCommandLatencyTotal {0};
+Uint64 gCommandLatencyMax {0};
+std::atomic<bool> gQuit {false};
+// Physics steps run so far, on the simulation thread
+std::uint64_t gStepCount {0};
 
 int init(void) {
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
@@ -153,30 +276,56 @@ int init(void) {
     gRenderer = SDL_CreateRenderer(gWindow,
 				       -1,
 				       SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    if (gRenderer == nullptr) {
+	// No GPU: draw on the CPU and only hand SDL finished frames
+	gRenderer = SDL_CreateRenderer(gWindow, -1, SDL_RENDERER_SOFTWARE);
+	gRenderMode = RenderMode::Software;
+    }
+    if (gRenderer == nullptr) {
+	SDL_Log("SDL_CreateRenderer Error: %s\n", SDL_GetError());
+	return 0;
+    }
+    gFramebufferTexture = SDL_CreateTexture(gRenderer,
+					    gFramebufferFormat,
+					    SDL_TEXTUREACCESS_STREAMING,
+					    gScreenWidth,
+					    gScreenHeight);
     gWorld = {};
+    update_step_constants();
     gBackgroundColor = {};
 
     return 1;
 }
 
 void init_squares(void) {
+    gSquares.reserve(gNumSquares);
     for (int i = 0; i < gNumSquares; ++i) {
-	auto square = new Square({100.0, 100.0},
-			    {gScreenWidth / 2, gScreenHeight / 2},
-			    get_random_velocity());
-	// Set color
-	square->setColor(get_random_color());
-	gSquares.push_back(square);
+	double size = gMinSquareSize == gMaxSquareSize
+	    ? gMinSquareSize : get_random_int(gMinSquareSize, gMaxSquareSize);
+	gSquares.add({size, size},
+		     {gScreenWidth / 2, gScreenHeight / 2},
+		     {});
     }
+    // Random velocities and colors for all squares in bulk
+    RandomLanes& random = thread_random().lanes;
+    random.ints(gSquares.vel_x.data(), gSquares.size(), -gMaxStartSpeed, gMaxStartSpeed);
+    random.ints(gSquares.vel_y.data(), gSquares.size(), -gMaxStartSpeed, gMaxStartSpeed);
+    // Pixels per second to pixels per step
+    const double dt = gTimestep.step_seconds;
+    for (std::size_t i = 0; i < gSquares.size(); ++i) {
+	gSquares.vel_x[i] *= dt;
+	gSquares.vel_y[i] *= dt;
+    }
+    random.colors(gSquares.color.data(), gSquares.size());
 }
 
 void init_square(void) {
     // Init square
-    gSquare = new Square({100.0, 100.0},
-			 {gScreenWidth / 2, gScreenHeight / 2},
-			 get_random_velocity());
-    // Setup square color
-    gSquare->setColor(get_random_color());
+    gSingleSquare.clear();
+    gSquare = gSingleSquare.add({100.0, 100.0},
+				{gScreenWidth / 2, gScreenHeight / 2},
+				get_random_velocity(),
+				get_random_color());
 }
 
 void draw(void) {
@@ -185,13 +334,13 @@ void draw(void) {
     SDL_RenderClear(gRenderer);
 
     // Set gRenderer color for painting square
-    set_color(gRenderer, gSquare->color());
+    set_color(gRenderer, gSquare.color());
 
     // Draw
-    SDL_Rect rect = { .x = static_cast<int>(gSquare->position().x),
-		      .y = static_cast<int>(gSquare->position().y),
-		      .w = static_cast<int>(gSquare->size().x),
-		      .h = static_cast<int>(gSquare->size().y) };
+    SDL_Rect rect = { .x = static_cast<int>(gSquare.position().x),
+		      .y = static_cast<int>(gSquare.position().y),
+		      .w = static_cast<int>(gSquare.size().x),
+		      .h = static_cast<int>(gSquare.size().y) };
     SDL_RenderFillRect(gRenderer, &rect);
     
     // Update the screen
@@ -199,180 +348,686 @@ void draw(void) {
 }
 
 
-void draw_squares(void) {
+void save_previous_positions(void) {
+    gPrevPosX.assign(gSquares.pos_x.begin(), gSquares.pos_x.end());
+    gPrevPosY.assign(gSquares.pos_y.begin(), gSquares.pos_y.end());
+}
+
+// Copy the squares as they are after the last step to the render thread
+void publish_snapshot(void) {
+    Snapshot& snapshot = gSnapshots.back();
+    snapshot.prev_x.assign(gPrevPosX.begin(), gPrevPosX.end());
+    snapshot.prev_y.assign(gPrevPosY.begin(), gPrevPosY.end());
+    snapshot.pos_x.assign(gSquares.pos_x.begin(), gSquares.pos_x.end());
+    snapshot.pos_y.assign(gSquares.pos_y.begin(), gSquares.pos_y.end());
+    snapshot.size_x.assign(gSquares.size_x.begin(), gSquares.size_x.end());
+    snapshot.size_y.assign(gSquares.size_y.begin(), gSquares.size_y.end());
+    snapshot.color.assign(gSquares.color.begin(), gSquares.color.end());
+    snapshot.step = gStepCount;
+    snapshot.counter = SDL_GetPerformanceCounter();
+    gSnapshots.publish();
+}
+
+// Screen rect for square i drawn alpha of the way from its previous to
+// its current physics position
+SDL_Rect square_rect(const Snapshot& snapshot, std::size_t i, double alpha) {
+    double x = snapshot.prev_x[i] + (snapshot.pos_x[i] - snapshot.prev_x[i]) * alpha;
+    double y = snapshot.prev_y[i] + (snapshot.pos_y[i] - snapshot.prev_y[i]) * alpha;
+    return { .x = static_cast<int>(x),
+	     .y = static_cast<int>(y),
+	     .w = static_cast<int>(snapshot.size_x[i]),
+	     .h = static_cast<int>(snapshot.size_y[i]) };
+}
+
+// Draw the squares into gFramebuffer in index order
+void raster_squares(const Snapshot& snapshot, double alpha) {
+    if (gTiledRaster) {
+	gTileRasterizer.draw(gFramebuffer, gJobs, argb_pixel(gBackgroundColor), snapshot.size(),
+			     [&snapshot, alpha](std::size_t i) {
+				 return RasterRect {square_rect(snapshot, i, alpha),
+						    argb_pixel(snapshot.color[i])};
+			     });
+	return;
+    }
+    gTileRasterizer.invalidate();
+    gFramebuffer.clear(argb_pixel(gBackgroundColor));
+    for (std::size_t i = 0; i < snapshot.size(); ++i) {
+	gFramebuffer.fill_rect(square_rect(snapshot, i, alpha), argb_pixel(snapshot.color[i]));
+    }
+}
+
+// Hand the frame about to be presented to gCapture and gStream, from
+// gFramebuffer if it holds the frame or else read back from gRenderer
+void capture_frame(bool from_framebuffer) {
+    if (gCapture.active()) {
+	if (from_framebuffer) {
+	    gCapture.capture(gFramebuffer);
+	} else if (Uint32* pixels = gCapture.begin_frame()) {
+	    if (SDL_RenderReadPixels(gRenderer, nullptr, gFramebufferFormat,
+				     pixels, gCapture.pitchBytes()) == 0) {
+		gCapture.end_frame();
+	    } else {
+		gCapture.cancel_frame();
+	    }
+	}
+    }
+    if (gStream.active()) {
+	if (from_framebuffer) {
+	    gStream.submit(gFramebuffer);
+	} else if (Uint32* pixels = gStream.begin_frame()) {
+	    if (SDL_RenderReadPixels(gRenderer, nullptr, SDL_PIXELFORMAT_RGBA32,
+				     pixels, gStream.pitchBytes()) == 0) {
+		gStream.end_frame();
+	    } else {
+		gStream.cancel_frame();
+	    }
+	}
+    }
+}
+
+void draw_squares(const Snapshot& snapshot, double alpha) {
+    if (gRenderMode == RenderMode::Software && gFramebufferTexture != nullptr) {
+	raster_squares(snapshot, alpha);
+	if (gTiledRaster) {
+	    // The texture keeps the rest from earlier frames
+	    for (const SDL_Rect& rect : gTileRasterizer.dirtyRects()) {
+		gFramebuffer.upload(gFramebufferTexture, rect);
+	    }
+	} else {
+	    gFramebuffer.upload(gFramebufferTexture);
+	}
+	SDL_RenderCopy(gRenderer, gFramebufferTexture, nullptr, nullptr);
+	capture_frame(true);
+	SDL_RenderPresent(gRenderer);
+	return;
+    }
     // Draw background
     set_color(gRenderer, gBackgroundColor);
     SDL_RenderClear(gRenderer);
-    for (auto square : gSquares) {
-	// Set gRenderer color for painting square
-	set_color(gRenderer, square->color());
+    switch (gRenderMode) {
+    case RenderMode::Immediate:
+	for (std::size_t i = 0; i < snapshot.size(); ++i) {
+	    // Set gRenderer color for painting square
+	    set_color(gRenderer, snapshot.color[i]);
 
-	// Draw
-	SDL_Rect rect = { .x = static_cast<int>(square->position().x),
-			  .y = static_cast<int>(square->position().y),
-			  .w = static_cast<int>(square->size().x),
-			  .h = static_cast<int>(square->size().y) };
-	SDL_RenderFillRect(gRenderer, &rect);
+	    // Draw
+	    SDL_Rect rect = square_rect(snapshot, i, alpha);
+	    SDL_RenderFillRect(gRenderer, &rect);
+	}
+	break;
+    case RenderMode::Batched:
+	gRectBatch.clear();
+	for (std::size_t i = 0; i < snapshot.size(); ++i) {
+	    gRectBatch.add(snapshot.color[i], square_rect(snapshot, i, alpha));
+	}
+	gRectBatch.submit(gRenderer);
+	break;
+    case RenderMode::Geometry:
+	gGeometryBatch.clear();
+	for (std::size_t i = 0; i < snapshot.size(); ++i) {
+	    gGeometryBatch.add(snapshot.color[i], square_rect(snapshot, i, alpha));
+	}
+	gGeometryBatch.submit(gRenderer);
+	break;
+    case RenderMode::Software:
+	// Without a texture to upload to, fall back to plain fills
+	for (std::size_t i = 0; i < snapshot.size(); ++i) {
+	    set_color(gRenderer, snapshot.color[i]);
+	    SDL_Rect rect = square_rect(snapshot, i, alpha);
+	    SDL_RenderFillRect(gRenderer, &rect);
+	}
+	break;
     }
+    capture_frame(false);
     // Update the screen
     SDL_RenderPresent(gRenderer);
 }
 
+void next_render_mode(void) {
+    switch (gRenderMode) {
+    case RenderMode::Immediate:
+	gRenderMode = RenderMode::Batched;
+	break;
+    case RenderMode::Batched:
+	gRenderMode = RenderMode::Geometry;
+	break;
+    case RenderMode::Geometry:
+	gRenderMode = RenderMode::Software;
+	break;
+    case RenderMode::Software:
+	gRenderMode = RenderMode::Immediate;
+	break;
+    }
+}
+
 
 void update(void) {
     // Apply gravity
-    gSquare->applyGravity(gWorld.gravity);
+    gSquare.applyGravity(gStepWorld.gravity);
     // Apply air resistance to horizontal movement
-    gSquare->applyAirResistance(gWorld.air_resistance);
+    gSquare.applyAirResistance(gStepWorld.air_resistance);
 
     // Update position
-    gSquare->updatePosition();
+    gSquare.updatePosition();
 
     // Handle collisions
-    bool is_on_right_wall = (gSquare->position().x >= gScreenWidth - gSquare->size().x);
-    bool is_on_left_wall = (gSquare->position().x <= 0);
+    bool is_on_right_wall = (gSquare.position().x >= gScreenWidth - gSquare.size().x);
+    bool is_on_left_wall = (gSquare.position().x <= 0);
     bool is_on_wall = (is_on_right_wall || is_on_left_wall);
-    bool is_on_floor = (gSquare->position().y >= gScreenHeight - gSquare->size().y);
-    bool is_on_ceiling = (gSquare->position().y <= 0);
+    bool is_on_floor = (gSquare.position().y >= gScreenHeight - gSquare.size().y);
+    bool is_on_ceiling = (gSquare.position().y <= 0);
 
     if (is_on_wall) {
 	// Reset x on boundries
 	if (is_on_left_wall) {
-	    gSquare->setPosX(0);
+	    gSquare.setPosX(0);
 	}
 	if (is_on_right_wall) {
-	    gSquare->setPosX(gScreenWidth - gSquare->size().x);
+	    gSquare.setPosX(gScreenWidth - gSquare.size().x);
 	}
 	// Bounce off wall with some energy loss
-	gSquare->dampX(gWorld.damping);
+	gSquare.dampX(gStepWorld.damping);
 	// Change to random
-	gSquare->setColor(get_random_color());
+	gSquare.setColor(get_random_color());
     }
 
     if (is_on_floor) {
-	gSquare->setPosY(gScreenHeight - gSquare->size().y);
+	gSquare.setPosY(gScreenHeight - gSquare.size().y);
 	// Only bounce if moving fast enough
-	if (gSquare->velocity().y > 0.5) {
-	    gSquare->dampY(gWorld.damping);
+	if (gSquare.velocity().y > gStepWorld.rest_speed) {
+	    gSquare.dampY(gStepWorld.damping);
 	    // Change to random color
-	    gSquare->setColor(get_random_color());
+	    gSquare.setColor(get_random_color());
 	} else {
 	    // Ground friction
-	    gSquare->setVelocity({gSquare->velocity().x * 0.95, 0});
+	    gSquare.setVelocity({gSquare.velocity().x * gStepWorld.ground_friction, 0});
 	}
     }
     if (is_on_ceiling) {
 	// Bounce off the ceiling w/o loss
-	gSquare->setPosY(0);
-	gSquare->dampY(gWorld.damping);
+	gSquare.setPosY(0);
+	gSquare.dampY(gStepWorld.damping);
 	// Change to random color
-	gSquare->setColor(get_random_color());
+	gSquare.setColor(get_random_color());
     }
 }
 
+void collide_squares(void) {
+    gPairs.clear();
+    if (gBroadphase == Broadphase::None) {
+	return;
+    }
+    // Fast squares are found along their whole move
+    gSubsteps.sweep_boxes(gSquares);
+    switch (gBroadphase) {
+    case Broadphase::None:
+	break;
+    case Broadphase::SpatialHash:
+	gGrid.build(gSquares);
+	gGrid.find_pairs(gSquares, gPairs);
+	break;
+    case Broadphase::SweepAndPrune:
+	gSweep.update(gSquares);
+	gSweep.find_pairs(gSquares, gPairs);
+	break;
+    case Broadphase::AabbTree:
+	gTree.update(gSquares);
+	gTree.find_pairs(gSquares, gPairs);
+	break;
+    case Broadphase::Quadtree:
+	gQuadtree.update(gSquares);
+	gQuadtree.find_pairs(gSquares, gPairs);
+	break;
+    }
+    // The grid is rebuilt every step; the others carry their order over
+    if (gBroadphase != Broadphase::SpatialHash) {
+	sort_pairs(gPairs);
+    }
+    gSubsteps.restore(gSquares);
+    gSleep.filter_pairs(gPairs);
+    gSubsteps.take_pairs(gPairs);
+    resolve_pairs(gSquares, gPairs, gStepWorld.restitution);
+    gSubsteps.step(gSquares, gStepWorld.gravity, gStepWorld.air_resistance, gStepWorld.restitution);
+}
+
+void next_broadphase(void) {
+    switch (gBroadphase) {
+    case Broadphase::None:
+	gBroadphase = Broadphase::SpatialHash;
+	break;
+    case Broadphase::SpatialHash:
+	gBroadphase = Broadphase::SweepAndPrune;
+	break;
+    case Broadphase::SweepAndPrune:
+	gBroadphase = Broadphase::AabbTree;
+	break;
+    case Broadphase::AabbTree:
+	gBroadphase = Broadphase::Quadtree;
+	break;
+    case Broadphase::Quadtree:
+	gBroadphase = Broadphase::None;
+	break;
+    }
+}
+
+// Push the square at x, y, waking it and whatever it rests on. force is
+// the change in velocity, in pixels per second.
+void apply_force_at(int x, int y, Vec2 force) {
+    gTree.update(gSquares);
+    long picked = gTree.pick(gSquares, x, y);
+    if (picked < 0) {
+	return;
+    }
+    gSleep.wake(picked);
+    Square square = gSquares[picked];
+    const double dt = gTimestep.step_seconds;
+    square.setVelocity({square.velocity().x + force.x * dt, square.velocity().y + force.y * dt});
+    square.setColor(get_random_color());
+}
+
+// Add a square centered on x, y. Grows the store, so it can allocate.
+// The new square starts out where it was "before the last step" too, so
+// a snapshot published before the next step still has a previous
+// position for every square.
+void spawn_square_at(int x, int y) {
+    double size = gMinSquareSize == gMaxSquareSize
+	? gMinSquareSize : get_random_int(gMinSquareSize, gMaxSquareSize);
+    Square square = gSquares.add({size, size},
+				 {x - size / 2, y - size / 2},
+				 get_random_velocity(),
+				 get_random_color());
+    gPrevPosX.push_back(square.position().x);
+    gPrevPosY.push_back(square.position().y);
+}
+
+// One physics step. Expects save_previous_positions() to have been
+// called first: fast squares are swept from there.
 void update_squares(void) {
-    for (auto square : gSquares) {
-	// Apply gravity
-	square->applyGravity(gWorld.gravity);
-	// Apply air resistance to horizontal movement
-	square->applyAirResistance(gWorld.air_resistance);
-
-	// Update position
-	square->updatePosition();
-
-	// Handle collisions
-	bool is_on_right_wall = (square->position().x >= gScreenWidth - square->size().x);
-	bool is_on_left_wall = (square->position().x <= 0);
-	bool is_on_wall = (is_on_right_wall || is_on_left_wall);
-	bool is_on_floor = (square->position().y >= gScreenHeight - square->size().y);
-	bool is_on_ceiling = (square->position().y <= 0);
-
-	if (is_on_wall) {
-	    // Reset x on boundries
-	    if (is_on_left_wall) {
-		square->setPosX(0);
-	    }
-	    if (is_on_right_wall) {
-		square->setPosX(gScreenWidth - square->size().x);
-	    }
-	    // Bounce off wall with some energy loss
-	    square->dampX(gWorld.damping);
-	    // Change to random
-	    square->setColor(get_random_color());
-	}
+    std::size_t count = gSquares.size();
+    std::size_t chunk = gJobs.chunkSize(count);
+    std::size_t chunks = JobSystem::chunkCount(count, chunk);
+    if (gBounced.size() < chunks) {
+	gBounced.resize(chunks);
+    }
+    // At most every square in a chunk bounces; reserving that up front
+    // keeps bounce-heavy frames off the heap
+    for (std::size_t c = 0; c < chunks; ++c) {
+	gBounced[c].reserve(chunk);
+    }
+    gSleep.begin_step(gSquares);
+    gSubsteps.begin(gSquares, chunks);
 
-	if (is_on_floor) {
-	    square->setPosY(gScreenHeight - square->size().y);
-	    // Only bounce if moving fast enough
-	    if (square->velocity().y > 0.5) {
-		square->dampY(gWorld.damping);
-		// Change to random color
-		square->setColor(get_random_color());
-	    } else {
-		// Ground friction
-		square->setVelocity({square->velocity().x * 0.95, 0});
+    gJobs.parallel_for(count, chunk, [](std::size_t c, std::size_t begin, std::size_t end) {
+	// Apply gravity, air resistance and update positions
+	gSleep.for_awake(begin, end, [c](std::size_t first, std::size_t last) {
+	    if (gBroadphase != Broadphase::None) {
+		gSubsteps.classify(gSquares, c, first, last, gStepWorld.gravity);
 	    }
+	    integrate_squares(gSquares, first, last,
+			      gStepWorld.gravity, gStepWorld.air_resistance,
+			      gIntegrateMode, gMaxSimdLevel);
+	});
+    });
+
+    // Squares bump into each other
+    collide_squares();
+
+    gJobs.parallel_for(count, chunk, [](std::size_t c, std::size_t begin, std::size_t end) {
+	// Handle collisions with the screen edges
+	gBounced[c].clear();
+	const Bounds bounds {gScreenWidth, gScreenHeight, gStepWorld.damping,
+			     gStepWorld.rest_speed, gStepWorld.ground_friction};
+	gSleep.for_awake(begin, end, [c, &bounds](std::size_t first, std::size_t last) {
+	    resolve_bounds(gSquares, gPrevPosX.data(), gPrevPosY.data(),
+			   first, last, bounds, gBounced[c], gMaxSimdLevel);
+	});
+    });
+
+    // Change bounced squares to a random color
+    for (std::size_t c = 0; c < chunks; ++c) {
+	for (auto i : gBounced[c]) {
+	    gSquares[i].setColor(get_random_color());
 	}
-	if (is_on_ceiling) {
-	    // Bounce off the ceiling w/o loss
-	    square->setPosY(0);
-	    square->dampY(gWorld.damping);
-	    // Change to random color
-	    square->setColor(get_random_color());
+    }
+
+    // Put squares that have settled to sleep
+    gSleep.end_step(gSquares, gPairs);
+}
+
+void toggle_sleep(void) {
+    gSleep.enabled = !gSleep.enabled;
+    gSleep.wake_all();
+}
+
+// Log what the last capture wrote and which frames it dropped
+void report_capture(void) {
+    SDL_Log("Captured %llu frames: %llu written, %llu dropped, %llu failed\n",
+	    static_cast<unsigned long long>(gCapture.frameCount()),
+	    static_cast<unsigned long long>(gCapture.writtenCount()),
+	    static_cast<unsigned long long>(gCapture.droppedCount()),
+	    static_cast<unsigned long long>(gCapture.failedCount()));
+    const std::vector<std::uint64_t>& dropped = gCapture.droppedFrames();
+    // Dropped frames as ranges of frame numbers
+    for (std::size_t i = 0; i < dropped.size();) {
+	std::size_t j = i;
+	while (j + 1 < dropped.size() && dropped[j + 1] == dropped[j] + 1) {
+	    ++j;
 	}
+	SDL_Log("  dropped %llu-%llu\n",
+		static_cast<unsigned long long>(dropped[i]),
+		static_cast<unsigned long long>(dropped[j]));
+	i = j + 1;
+    }
+    if (gCapture.droppedCount() > dropped.size()) {
+	SDL_Log("  and %llu more\n",
+		static_cast<unsigned long long>(gCapture.droppedCount() - dropped.size()));
+    }
+}
+
+void report_stream(void) {
+    SDL_Log("Streamed %llu of %llu frames (%llu bytes in %llu writes), "
+	    "%llu dropped, %llu waited on the reader for %.3f s (max %.2f ms), "
+	    "%llu short writes%s\n",
+	    static_cast<unsigned long long>(gStream.writtenCount()),
+	    static_cast<unsigned long long>(gStream.frameCount()),
+	    static_cast<unsigned long long>(gStream.bytesWritten()),
+	    static_cast<unsigned long long>(gStream.writeCalls()),
+	    static_cast<unsigned long long>(gStream.droppedCount()),
+	    static_cast<unsigned long long>(gStream.blockedCount()),
+	    gStream.blockedSeconds(),
+	    gStream.maxBlockedSeconds() * 1000.0,
+	    static_cast<unsigned long long>(gStream.shortWrites()),
+	    gStream.broken() ? ", reader went away" : "");
+}
+
+void toggle_capture(void) {
+    if (gCapture.active()) {
+	gCapture.stop();
+	report_capture();
+    } else if (!gCapture.start(gCaptureDirectory, FrameCapture::Format::Ppm,
+				gScreenWidth, gScreenHeight)) {
+	SDL_Log("Can't capture to %s\n", gCaptureDirectory);
     }
 }
 
+// Save everything the next step depends on. Called between steps on
+// the thread that runs them, whose generators the steps draw from.
+bool save_world(const char* path) {
+    SnapshotScalars scalars;
+    scalars.gravity = gWorld.gravity;
+    scalars.damping = gWorld.damping;
+    scalars.air_resistance = gWorld.air_resistance;
+    scalars.restitution = gWorld.restitution;
+    scalars.rest_speed = gWorld.rest_speed;
+    scalars.ground_friction = gWorld.ground_friction;
+    scalars.step_seconds = gTimestep.step_seconds;
+    scalars.step = gStepCount;
+    scalars.broadphase = static_cast<std::uint32_t>(gBroadphase);
+    scalars.integrate_mode = static_cast<std::uint32_t>(gIntegrateMode);
+    scalars.sleep_enabled = gSleep.enabled;
+    ThreadRandom& random = thread_random();
+    random.generator.getState(scalars.random);
+    random.lanes.getState(scalars.random_lanes);
+    return save_snapshot(path, scalars, gSquares, gSleep);
+}
+
+// Pick up a world saved by save_world() on the thread that will step
+// it. Files with settings this build doesn't have, or saved at another
+// physics rate (velocities are per step), are refused. Stepping on
+// from there matches the saved run bit for bit.
+bool load_world(const char* path) {
+    SnapshotScalars scalars;
+    // Quadtree and Fast are the last of their enums
+    auto accept = [](const SnapshotScalars& saved) {
+	return saved.broadphase <= static_cast<std::uint32_t>(Broadphase::Quadtree)
+	    && saved.integrate_mode <= static_cast<std::uint32_t>(IntegrateMode::Fast)
+	    && saved.step_seconds == gTimestep.step_seconds;
+    };
+    if (!load_snapshot(path, scalars, gSquares, gSleep, accept)) {
+	return false;
+    }
+    gWorld.gravity = scalars.gravity;
+    gWorld.damping = scalars.damping;
+    gWorld.air_resistance = scalars.air_resistance;
+    gWorld.restitution = scalars.restitution;
+    gWorld.rest_speed = scalars.rest_speed;
+    gWorld.ground_friction = scalars.ground_friction;
+    update_step_constants();
+    gStepCount = scalars.step;
+    gBroadphase = static_cast<Broadphase>(scalars.broadphase);
+    gIntegrateMode = static_cast<IntegrateMode>(scalars.integrate_mode);
+    gSleep.enabled = scalars.sleep_enabled != 0;
+    ThreadRandom& random = thread_random();
+    random.generator.setState(scalars.random);
+    random.lanes.setState(scalars.random_lanes);
+    save_previous_positions();
+    return true;
+}
+
 void close(void) {
+    if (gFramebufferTexture != nullptr) {
+	SDL_DestroyTexture(gFramebufferTexture);
+    }
     SDL_DestroyRenderer(gRenderer);
     SDL_DestroyWindow(gWindow);
-    delete gSquare;
     SDL_Quit();    
 }
 
 void reinit_square(void) {
-    delete gSquare;
     init_square();
 }
 
 void reinit_squares(void) {
-    for (auto square : gSquares) {
-	delete square;
-    }
     gSquares.clear();
     init_squares();
+    save_previous_positions();
+}
+
+// Called from the render thread. Input that doesn't fit in the queue is
+// dropped rather than waited on.
+void push_command(Command command) {
+    command.timestamp = SDL_GetPerformanceCounter();
+    if (!gCommands.try_push(command)) {
+	++gDroppedCommands;
+    }
 }
 
-int main(void)
+// Run the queued commands stamped up to until on the simulation thread.
+// Returns whether there were any.
+bool run_commands(Uint64 until) {
+    bool ran = false;
+    while (const Command* next = gCommands.front()) {
+	const Command command = *next;
+	if (command.timestamp > until) {
+	    break;
+	}
+	gCommands.pop();
+	ran = true;
+	const Uint64 latency = SDL_GetPerformanceCounter() - command.timestamp;
+	++gCommandCount;
+	gCommandLatencyTotal += latency;
+	gCommandLatencyMax = std::max(gCommandLatencyMax, latency);
+	switch (command.type) {
+	case Command::Type::Reset:
+	    reinit_squares();
+	    break;
+	case Command::Type::NextBroadphase:
+	    next_broadphase();
+	    break;
+	case Command::Type::ToggleSleep:
+	    toggle_sleep();
+	    break;
+	case Command::Type::Spawn:
+	    spawn_square_at(command.x, command.y);
+	    break;
+	case Command::Type::ApplyForce:
+	    apply_force_at(command.x, command.y, {command.force_x, command.force_y});
+	    break;
+	case Command::Type::SaveSnapshot:
+	    if (!save_world(gSnapshotPath)) {
+		SDL_Log("Can't save %s\n", gSnapshotPath);
+	    }
+	    break;
+	case Command::Type::LoadSnapshot:
+	    if (!load_world(gSnapshotPath)) {
+		SDL_Log("Can't load %s\n", gSnapshotPath);
+	    }
+	    break;
+	}
+    }
+    return ran;
+}
+
+// Simulation thread: runs fixed physics steps in real time and
+// publishes a snapshot after each batch of them, never waiting on the
+// render thread
+void simulation_loop(void) {
+    const double frequency = SDL_GetPerformanceFrequency();
+    const double counter_seconds = 1.0 / frequency;
+    Uint64 last_counter = SDL_GetPerformanceCounter();
+    while (!gQuit.load(std::memory_order_acquire)) {
+	Uint64 counter = SDL_GetPerformanceCounter();
+	int steps = gTimestep.advance((counter - last_counter) * counter_seconds);
+	last_counter = counter;
+	// Nothing to catch up on: take all input so far
+	bool changed = steps == 0 && run_commands(counter);
+	for (int i = 0; i < steps; ++i) {
+	    // Real time step i stands for, counting back from now
+	    double behind = gTimestep.accumulator + (steps - 1 - i) * gTimestep.step_seconds;
+	    changed |= run_commands(counter - static_cast<Uint64>(behind * frequency));
+	    save_previous_positions();
+	    update_squares();
+	    ++gStepCount;
+	}
+	if (steps > 0 || changed) {
+	    publish_snapshot();
+	} else {
+	    // Nothing due until the accumulator fills up again
+	    double wait = gTimestep.step_seconds - gTimestep.accumulator;
+	    std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+	}
+    }
+}
+
+// The benchmark includes this file for the simulation and supplies its
+// own main()
+#ifndef GRAVITY_SQUARE_NO_MAIN
+// --hz N runs physics N times a second instead of gPhysicsHz; the
+// squares move just as fast, only sampled more or less finely.
+// --stream-fd N streams raw RGBA frames to descriptor N, e.g.
+//   ./sdl-gravity-square --stream-fd 3
+//       3> >(ffmpeg -f rawvideo -pix_fmt rgba -s 640x480 -r 60 -i - out.mp4)
+int main(int argc, char* argv[])
 {
+    int stream_fd = -1;
+    double hz = gPhysicsHz;
+    auto usage = [argv]() {
+	SDL_Log("usage: %s [--stream-fd N] [--hz PHYSICS_RATE]\n", argv[0]);
+	return 2;
+    };
+    for (int i = 1; i < argc; ++i) {
+	if (std::strcmp(argv[i], "--stream-fd") == 0 && i + 1 < argc) {
+	    stream_fd = std::atoi(argv[++i]);
+	} else if (std::strcmp(argv[i], "--hz") == 0 && i + 1 < argc) {
+	    hz = std::atof(argv[++i]);
+	} else {
+	    return usage();
+	}
+    }
+    if (!(hz > 0.0)) {
+	return usage();
+    }
+    set_physics_hz(hz);
     if (!init()) {
 	return 1;
     }
+    if (stream_fd >= 0) {
+	gStream.start(stream_fd, gScreenWidth, gScreenHeight);
+    }
 
-    // Create an event handler and a quit flag
+    // Create an event handler
     SDL_Event e{};
-    bool quit {false};
 
+    if (gRandomSeed != 0) {
+	seed_random(gRandomSeed);
+    }
     //init_square();
     init_squares();
+    save_previous_positions();
+    // Size everything shared between the threads up front
+    gSnapshots.for_each([](Snapshot& snapshot) { snapshot.reserve(gSquares.size()); });
+    publish_snapshot();
+    // Physics runs on its own thread from here on; this one only
+    // handles input and draws
+    std::thread simulation(simulation_loop);
+    const double counter_seconds = 1.0 / SDL_GetPerformanceFrequency();
     // Main loop
-    while (!quit) {
-	// TODO: Add reset
+    while (!gQuit.load(std::memory_order_relaxed)) {
+	std::uint64_t allocations = heap_allocation_count();
 	while (SDL_PollEvent(&e) != 0) {
 	    if (e.type == SDL_QUIT) {
-		quit = true;
+		gQuit.store(true, std::memory_order_release);
 	    } else if (e.type == SDL_KEYDOWN) {
 		if (e.key.keysym.sym == SDLK_SPACE) {
-		    reinit_squares();
+		    push_command({Command::Type::Reset});
+		} else if (e.key.keysym.sym == SDLK_b) {
+		    next_render_mode();
+		} else if (e.key.keysym.sym == SDLK_c) {
+		    push_command({Command::Type::NextBroadphase});
+		} else if (e.key.keysym.sym == SDLK_s) {
+		    push_command({Command::Type::ToggleSleep});
+		} else if (e.key.keysym.sym == SDLK_p) {
+		    toggle_capture();
+		} else if (e.key.keysym.sym == SDLK_F5) {
+		    push_command({Command::Type::SaveSnapshot});
+		} else if (e.key.keysym.sym == SDLK_F9) {
+		    push_command({Command::Type::LoadSnapshot});
+		}
+	    } else if (e.type == SDL_MOUSEBUTTONDOWN) {
+		if (e.button.button == SDL_BUTTON_LEFT) {
+		    // Launch it upwards
+		    push_command({Command::Type::ApplyForce, 0, e.button.x, e.button.y, 0.0, -gClickSpeed});
+		} else if (e.button.button == SDL_BUTTON_RIGHT) {
+		    push_command({Command::Type::Spawn, 0, e.button.x, e.button.y});
 		}
 	    }
 	}
+	// Draw the newest finished step, interpolating towards it over
+	// the step after it was published. Vsync paces the loop.
+	gSnapshots.update();
+	const Snapshot& snapshot = gSnapshots.front();
+	double alpha = (SDL_GetPerformanceCounter() - snapshot.counter) * counter_seconds
+	    / gTimestep.step_seconds;
 	// draw();
-	draw_squares();
-	// update();
-	update_squares();
-	SDL_Delay(15);
+	draw_squares(snapshot, std::min(alpha, 1.0));
+
+	// The first physics step sizes the simulation's buffers; after
+	// that nothing should allocate on either thread, including reinits
+	if (snapshot.step > 0 && gFrames++ > 0 && heap_allocation_count() != allocations) {
+	    ++gAllocatingFrames;
+	}
+    }
+    simulation.join();
+    if (gCapture.active()) {
+	gCapture.stop();
+	report_capture();
+    }
+    if (gStream.active()) {
+	gStream.stop();
+	report_stream();
+    }
+    if (gCommandCount > 0) {
+	const double ms = 1000.0 / SDL_GetPerformanceFrequency();
+	SDL_Log("%llu inputs, latency %.2f ms average, %.2f ms max, %llu dropped\n",
+		static_cast<unsigned long long>(gCommandCount),
+		gCommandLatencyTotal * ms / gCommandCount,
+		gCommandLatencyMax * ms,
+		static_cast<unsigned long long>(gDroppedCommands));
     }
+    SDL_Log("%llu of %llu frames allocated from the heap\n",
+	    static_cast<unsigned long long>(gAllocatingFrames),
+	    static_cast<unsigned long long>(gFrames));
     close();
     return 0;
 }
+#endif
@@ -0,0 +1,428 @@
+#ifndef SOFTWARE_RASTER_H
+#define SOFTWARE_RASTER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "SDL2/SDL.h"
+
+#include "job-system.h"
+#include "square-simd.h"
+#include "square-store.h"
+
+// Pixel layout of Framebuffer, as SDL names it
+constexpr Uint32 gFramebufferFormat {SDL_PIXELFORMAT_ARGB8888};
+
+inline Uint32 argb_pixel(Color color)
+{
+    return (static_cast<Uint32>(color.alpha) << 24)
+	| (static_cast<Uint32>(color.red) << 16)
+	| (static_cast<Uint32>(color.green) << 8)
+	| static_cast<Uint32>(color.blue);
+}
+
+// Set n pixels in each of rows rows starting at dst, pitch pixels apart
+inline void fill_rows_scalar(Uint32* dst, std::size_t pitch, std::size_t rows,
+			     std::size_t n, Uint32 pixel)
+{
+    for (std::size_t y = 0; y < rows; ++y, dst += pitch) {
+	for (std::size_t i = 0; i < n; ++i) {
+	    dst[i] = pixel;
+	}
+    }
+}
+
+#ifdef SQUARE_SIMD_X86
+// Spans of at least one vector finish with an unaligned store ending on
+// the last pixel instead of a scalar tail; it rewrites a few pixels with
+// the same value, which is cheaper than the loop.
+__attribute__((target("sse2")))
+inline void fill_rows_sse2(Uint32* dst, std::size_t pitch, std::size_t rows,
+			   std::size_t n, Uint32 pixel)
+{
+    if (n < 4) {
+	fill_rows_scalar(dst, pitch, rows, n, pixel);
+	return;
+    }
+    const __m128i p = _mm_set1_epi32(static_cast<int>(pixel));
+    for (std::size_t y = 0; y < rows; ++y, dst += pitch) {
+	for (std::size_t i = 0; i + 4 <= n; i += 4) {
+	    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), p);
+	}
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + n - 4), p);
+    }
+}
+
+__attribute__((target("avx2")))
+inline void fill_rows_avx2(Uint32* dst, std::size_t pitch, std::size_t rows,
+			   std::size_t n, Uint32 pixel)
+{
+    if (n < 8) {
+	fill_rows_sse2(dst, pitch, rows, n, pixel);
+	return;
+    }
+    const __m256i p = _mm256_set1_epi32(static_cast<int>(pixel));
+    for (std::size_t y = 0; y < rows; ++y, dst += pitch) {
+	std::size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+	    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), p);
+	    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 8), p);
+	    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 16), p);
+	    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 24), p);
+	}
+	for (; i + 8 <= n; i += 8) {
+	    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), p);
+	}
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + n - 8), p);
+    }
+}
+#endif
+
+// 32-bit ARGB image drawn on the CPU, for machines without a GPU
+// renderer and for anything that wants the pixels themselves. Rows
+// start on cache lines. Rectangles are clipped to the image and filled
+// row by row with the widest span kernel the CPU has.
+class Framebuffer
+{
+public:
+    // Widest span kernel to use
+    SimdLevel max_level {SimdLevel::AVX2};
+
+private:
+    int m_width {0};
+    int m_height {0};
+    // Row stride in pixels
+    std::size_t m_pitch {0};
+    AlignedVector<Uint32> m_pixels;
+
+public:
+    Framebuffer() = default;
+    Framebuffer(int width, int height) { resize(width, height); }
+
+    void resize(int width, int height) {
+	m_width = width;
+	m_height = height;
+	constexpr std::size_t line = gCacheLineSize / sizeof(Uint32);
+	m_pitch = (static_cast<std::size_t>(width) + line - 1) / line * line;
+	m_pixels.assign(m_pitch * height, 0);
+    }
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    std::size_t pitch() const { return m_pitch; }
+    // Row stride in bytes, as SDL wants it
+    int pitchBytes() const { return static_cast<int>(m_pitch * sizeof(Uint32)); }
+    const Uint32* pixels() const { return m_pixels.data(); }
+    const Uint32* row(int y) const { return m_pixels.data() + y * m_pitch; }
+
+    SimdLevel level() const { return std::min(detect_simd_level(), max_level); }
+
+    void clear(Uint32 pixel) {
+	fill_rect({0, 0, m_width, m_height}, pixel);
+    }
+
+    void fill_rect(const SDL_Rect& rect, Uint32 pixel) {
+	fill_rect(rect, {0, 0, m_width, m_height}, pixel);
+    }
+
+    // Fill the part of rect inside clip. Threads may fill at the same
+    // time as long as their clip rects don't share a cache line.
+    void fill_rect(const SDL_Rect& rect, const SDL_Rect& clip, Uint32 pixel) {
+	const int x0 = std::max({rect.x, clip.x, 0});
+	const int y0 = std::max({rect.y, clip.y, 0});
+	const int x1 = std::min({rect.x + rect.w, clip.x + clip.w, m_width});
+	const int y1 = std::min({rect.y + rect.h, clip.y + clip.h, m_height});
+	if (x0 >= x1 || y0 >= y1) {
+	    return;
+	}
+	Uint32* dst = m_pixels.data() + y0 * m_pitch + x0;
+	const std::size_t rows = static_cast<std::size_t>(y1 - y0);
+	const std::size_t n = static_cast<std::size_t>(x1 - x0);
+	switch (level()) {
+#ifdef SQUARE_SIMD_X86
+	case SimdLevel::AVX2:
+	    fill_rows_avx2(dst, m_pitch, rows, n, pixel);
+	    return;
+	case SimdLevel::SSE2:
+	    fill_rows_sse2(dst, m_pitch, rows, n, pixel);
+	    return;
+#endif
+	default:
+	    fill_rows_scalar(dst, m_pitch, rows, n, pixel);
+	    return;
+	}
+    }
+
+    // Copy the image into a streaming texture of the same size in
+    // gFramebufferFormat
+    bool upload(SDL_Texture* texture) const {
+	return SDL_UpdateTexture(texture, nullptr, m_pixels.data(), pitchBytes()) == 0;
+    }
+
+    // Copy only rect, which must lie inside the image
+    bool upload(SDL_Texture* texture, const SDL_Rect& rect) const {
+	return SDL_UpdateTexture(texture, &rect, row(rect.y) + rect.x, pitchBytes()) == 0;
+    }
+};
+
+// A rectangle to fill and its color
+struct RasterRect {
+    SDL_Rect rect;
+    Uint32 pixel;
+
+    bool operator==(const RasterRect& other) const {
+	return rect.x == other.rect.x && rect.y == other.rect.y
+	    && rect.w == other.rect.w && rect.h == other.rect.h
+	    && pixel == other.pixel;
+    }
+};
+
+// Draws large numbers of rectangles into a Framebuffer on all threads
+// of a JobSystem. The image is cut into kTileSize square tiles, which
+// are a whole number of cache lines wide, so every tile is written by
+// exactly one thread and no locks are needed:
+//  1. Chunks of rectangles are binned in parallel. Each chunk has its
+//     own list per tile, so binning never writes shared state either.
+//  2. Tiles are filled in parallel, each walking its lists chunk by
+//     chunk, which keeps index order for overlaps.
+// Rectangles are opaque, so a tile starts from the last rectangle that
+// covers it completely and skips everything under it, clear included.
+// With heavily overlapping scenes most of the fill work is skipped
+// that way.
+//
+// With incremental set, the image left from the last draw() is kept
+// and only tiles under a rectangle that moved or changed color (where
+// it was and where it is now) are redrawn. dirtyRects() then lists the
+// redrawn area as a few merged rectangles, so callers can copy just
+// those on. Mostly resting scenes redraw a few tiles a frame.
+//
+// Lists keep their capacity across frames, so they stop allocating
+// once every tile has seen its busiest frame.
+class TileRasterizer
+{
+public:
+    static constexpr int kTileSize {64};
+
+    bool incremental {true};
+
+private:
+    // This frame's rectangles and the last frame's, swapped each draw
+    AlignedVector<RasterRect> m_rects;
+    AlignedVector<RasterRect> m_last_rects;
+    // Indices into m_rects, m_bins[chunk * tile count + tile]
+    std::vector<std::vector<std::uint32_t>> m_bins;
+    // Tiles each chunk found changes in, laid out like m_bins
+    std::vector<std::uint8_t> m_chunk_dirty;
+    std::vector<std::uint8_t> m_dirty;
+    std::vector<SDL_Rect> m_dirty_rects;
+    int m_tiles_x {0};
+    int m_tiles_y {0};
+    std::size_t m_chunks {0};
+    std::size_t m_redrawn {0};
+    // What the target held after the last draw(), if it still does
+    const Framebuffer* m_last_target {nullptr};
+    int m_last_width {0};
+    int m_last_height {0};
+    Uint32 m_last_background {0};
+
+    static bool covers(const SDL_Rect& rect, const SDL_Rect& tile) {
+	return rect.x <= tile.x && rect.y <= tile.y
+	    && rect.x + rect.w >= tile.x + tile.w
+	    && rect.y + rect.h >= tile.y + tile.h;
+    }
+
+    // Call fn(tile) for every tile rect overlaps
+    template <typename Fn>
+    void for_tiles(const SDL_Rect& rect, int width, int height, Fn&& fn) const {
+	const int x0 = std::max(rect.x, 0);
+	const int y0 = std::max(rect.y, 0);
+	const int x1 = std::min(rect.x + rect.w, width);
+	const int y1 = std::min(rect.y + rect.h, height);
+	if (x0 >= x1 || y0 >= y1) {
+	    return;
+	}
+	for (int ty = y0 / kTileSize; ty <= (y1 - 1) / kTileSize; ++ty) {
+	    for (int tx = x0 / kTileSize; tx <= (x1 - 1) / kTileSize; ++tx) {
+		fn(static_cast<std::size_t>(ty * m_tiles_x + tx));
+	    }
+	}
+    }
+
+    // Bin rectangles [begin, end) for chunk c. When tracking, also mark
+    // the tiles under the ones that changed since the last frame, which
+    // has compare_end of the same rectangles.
+    void bin(std::size_t c, std::size_t begin, std::size_t end,
+	     int width, int height, bool track, std::size_t compare_end) {
+	const std::size_t tiles = tileCount();
+	std::vector<std::uint32_t>* bins = m_bins.data() + c * tiles;
+	std::uint8_t* dirty = m_chunk_dirty.data() + c * tiles;
+	for (std::size_t i = begin; i < end; ++i) {
+	    const RasterRect& r = m_rects[i];
+	    for_tiles(r.rect, width, height, [bins, i](std::size_t t) {
+		bins[t].push_back(static_cast<std::uint32_t>(i));
+	    });
+	    const bool old = i < compare_end;
+	    if (!track || (old && r == m_last_rects[i])) {
+		continue;
+	    }
+	    auto mark = [dirty](std::size_t t) { dirty[t] = 1; };
+	    for_tiles(r.rect, width, height, mark);
+	    if (old) {
+		for_tiles(m_last_rects[i].rect, width, height, mark);
+	    }
+	}
+    }
+
+    bool tile_dirty(std::size_t t) const {
+	const std::size_t tiles = tileCount();
+	for (std::size_t c = 0; c < m_chunks; ++c) {
+	    if (m_chunk_dirty[c * tiles + t]) {
+		return true;
+	    }
+	}
+	return false;
+    }
+
+    void fill_tile(Framebuffer& target, std::size_t t, Uint32 background) const {
+	const std::size_t tiles = tileCount();
+	SDL_Rect tile = tileRect(t);
+	tile.w = std::min(tile.w, target.width() - tile.x);
+	tile.h = std::min(tile.h, target.height() - tile.y);
+	// Find the topmost rectangle hiding the whole tile
+	std::size_t first_chunk = 0;
+	std::size_t first = 0;
+	bool covered = false;
+	for (std::size_t c = m_chunks; c-- > 0 && !covered;) {
+	    const std::vector<std::uint32_t>& bin = m_bins[c * tiles + t];
+	    for (std::size_t k = bin.size(); k-- > 0;) {
+		if (covers(m_rects[bin[k]].rect, tile)) {
+		    first_chunk = c;
+		    first = k;
+		    covered = true;
+		    break;
+		}
+	    }
+	}
+	if (!covered) {
+	    target.fill_rect(tile, tile, background);
+	}
+	for (std::size_t c = first_chunk; c < m_chunks; ++c) {
+	    const std::vector<std::uint32_t>& bin = m_bins[c * tiles + t];
+	    for (std::size_t k = c == first_chunk ? first : 0; k < bin.size(); ++k) {
+		const RasterRect& r = m_rects[bin[k]];
+		target.fill_rect(r.rect, tile, r.pixel);
+	    }
+	}
+    }
+
+    // Merge the dirty tiles into rectangles: runs along each tile row,
+    // each joined onto a rectangle of the same span ending just above it
+    void merge_dirty(int width, int height) {
+	m_dirty_rects.clear();
+	for (int ty = 0; ty < m_tiles_y; ++ty) {
+	    for (int tx = 0; tx < m_tiles_x;) {
+		if (!m_dirty[ty * m_tiles_x + tx]) {
+		    ++tx;
+		    continue;
+		}
+		const int run = tx;
+		while (tx < m_tiles_x && m_dirty[ty * m_tiles_x + tx]) {
+		    ++tx;
+		}
+		const SDL_Rect rect {run * kTileSize, ty * kTileSize,
+				     std::min(tx * kTileSize, width) - run * kTileSize,
+				     std::min((ty + 1) * kTileSize, height) - ty * kTileSize};
+		auto above = std::find_if(m_dirty_rects.begin(), m_dirty_rects.end(),
+					  [&rect](const SDL_Rect& r) {
+					      return r.x == rect.x && r.w == rect.w
+						  && r.y + r.h == rect.y;
+					  });
+		if (above != m_dirty_rects.end()) {
+		    above->h += rect.h;
+		} else {
+		    m_dirty_rects.push_back(rect);
+		}
+	    }
+	}
+    }
+
+public:
+    std::size_t tileCount() const {
+	return static_cast<std::size_t>(m_tiles_x) * m_tiles_y;
+    }
+
+    SDL_Rect tileRect(std::size_t t) const {
+	return {static_cast<int>(t % m_tiles_x) * kTileSize,
+		static_cast<int>(t / m_tiles_x) * kTileSize,
+		kTileSize, kTileSize};
+    }
+
+    // Tiles the last draw() filled
+    std::size_t redrawnCount() const { return m_redrawn; }
+
+    // The area the last draw() changed, clipped to the target
+    const std::vector<SDL_Rect>& dirtyRects() const { return m_dirty_rects; }
+
+    // Call when something else drew into the target, so the next draw()
+    // repaints all of it
+    void invalidate() { m_last_target = nullptr; }
+
+    // Clear target to background and fill count rectangles over it in
+    // index order. rect_at(i) returns rectangle i as a RasterRect and is
+    // called from worker threads.
+    template <typename RectAt>
+    void draw(Framebuffer& target, JobSystem& jobs, Uint32 background,
+	      std::size_t count, RectAt&& rect_at) {
+	const int width = target.width();
+	const int height = target.height();
+	const bool full = !incremental
+	    || m_last_target != &target
+	    || width != m_last_width
+	    || height != m_last_height
+	    || background != m_last_background;
+	m_tiles_x = (width + kTileSize - 1) / kTileSize;
+	m_tiles_y = (height + kTileSize - 1) / kTileSize;
+	const std::size_t tiles = tileCount();
+	const std::size_t chunk = jobs.chunkSize(count);
+	m_chunks = count > 0 ? JobSystem::chunkCount(count, chunk) : 0;
+	if (m_bins.size() < m_chunks * tiles) {
+	    m_bins.resize(m_chunks * tiles);
+	}
+	for (std::size_t b = 0; b < m_chunks * tiles; ++b) {
+	    m_bins[b].clear();
+	}
+	m_chunk_dirty.assign(m_chunks * tiles, 0);
+	m_dirty.assign(tiles, full ? 1 : 0);
+	m_rects.swap(m_last_rects);
+	m_rects.resize(count);
+	// Rectangles past the end of the shorter frame count as changed
+	const std::size_t compare_end = std::min(count, m_last_rects.size());
+	for (std::size_t i = compare_end; !full && i < m_last_rects.size(); ++i) {
+	    for_tiles(m_last_rects[i].rect, width, height, [this](std::size_t t) { m_dirty[t] = 1; });
+	}
+
+	jobs.parallel_for(count, chunk, [&](std::size_t c, std::size_t begin, std::size_t end) {
+	    for (std::size_t i = begin; i < end; ++i) {
+		m_rects[i] = rect_at(i);
+	    }
+	    bin(c, begin, end, width, height, !full, compare_end);
+	});
+	jobs.parallel_for(tiles, 1, [&](std::size_t t, std::size_t, std::size_t) {
+	    if (m_dirty[t] || tile_dirty(t)) {
+		m_dirty[t] = 1;
+		fill_tile(target, t, background);
+	    }
+	});
+
+	m_redrawn = static_cast<std::size_t>(std::count(m_dirty.begin(), m_dirty.end(), 1));
+	merge_dirty(width, height);
+	m_last_target = &target;
+	m_last_width = width;
+	m_last_height = height;
+	m_last_background = background;
+    }
+};
+
+#endif // SOFTWARE_RASTER_H
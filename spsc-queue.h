@@ -0,0 +1,69 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+
+#include "square-store.h"
+
+// Bounded lock-free queue for one producer thread and one consumer
+// thread. Slots live inline in a power-of-two ring, so it never
+// allocates; pushing onto a full queue fails instead of blocking or
+// growing. Each side keeps a private copy of the other side's index and
+// only reloads the shared one when its copy says the queue is full (or
+// empty), so in the steady state the two threads don't touch each
+// other's cache lines.
+template <typename T, std::size_t Capacity>
+class SpscQueue
+{
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+		  "SpscQueue capacity must be a power of two");
+
+private:
+    static constexpr std::size_t kMask {Capacity - 1};
+
+    // Producer side
+    alignas(gCacheLineSize) std::atomic<std::size_t> m_tail {0};
+    std::size_t m_head_cache {0};
+    // Consumer side
+    alignas(gCacheLineSize) std::atomic<std::size_t> m_head {0};
+    std::size_t m_tail_cache {0};
+    alignas(gCacheLineSize) T m_slots[Capacity];
+
+public:
+    static constexpr std::size_t capacity() { return Capacity; }
+
+    // Producer only. Returns false if the queue is full.
+    bool try_push(const T& value) {
+	const std::size_t tail = m_tail.load(std::memory_order_relaxed);
+	if (tail - m_head_cache == Capacity) {
+	    m_head_cache = m_head.load(std::memory_order_acquire);
+	    if (tail - m_head_cache == Capacity) {
+		return false;
+	    }
+	}
+	m_slots[tail & kMask] = value;
+	m_tail.store(tail + 1, std::memory_order_release);
+	return true;
+    }
+
+    // Consumer only: the oldest item, or nullptr if the queue is empty.
+    // Stays valid until pop().
+    const T* front() {
+	const std::size_t head = m_head.load(std::memory_order_relaxed);
+	if (head == m_tail_cache) {
+	    m_tail_cache = m_tail.load(std::memory_order_acquire);
+	    if (head == m_tail_cache) {
+		return nullptr;
+	    }
+	}
+	return &m_slots[head & kMask];
+    }
+
+    // Consumer only: drop the item front() returned
+    void pop() {
+	m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+};
+
+#endif // SPSC_QUEUE_H
@@ -0,0 +1,292 @@
+#ifndef SQUARE_BOUNDS_H
+#define SQUARE_BOUNDS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#include "square-simd.h"
+#include "square-store.h"
+
+// Walls, floor and ceiling that squares bounce inside of
+struct Bounds {
+    double width {0.0};
+    double height {0.0};
+    double damping {0.9};
+    // Only bounce off the floor when falling faster than this
+    double rest_speed {0.5};
+    double ground_friction {0.95};
+    // Squares that moved further than this along an axis in one step
+    // bounce off the walls where they hit them
+    double fast_distance {2.0};
+};
+
+// Clamp squares [begin, end) inside bounds and bounce their velocities.
+// Same rules as the per-square collision code, but every body takes the
+// same path: all four boundary tests are evaluated up front as masks and
+// the results are blended in, so there is nothing to mispredict. Indices
+// of squares that bounced (and so want a new color) are appended to
+// bounced.
+//
+// Squares that moved more than fast_distance along an axis since
+// prev_x/prev_y are swept instead of clamped: the step is split at the
+// time of impact and the rest of the move is mirrored off the wall and
+// damped like the velocity, so a fast square bounces back from where it
+// hit rather than stopping flat against the wall for a step. That is a
+// blend like the clamp, so it costs no branches either. A square fast
+// enough to reach the opposite wall as well is clamped there.
+inline void resolve_bounds_scalar(SquareStore& store,
+				  const double* prev_x,
+				  const double* prev_y,
+				  std::size_t begin,
+				  std::size_t end,
+				  const Bounds& bounds,
+				  std::vector<std::size_t>& bounced)
+{
+    double* px = store.pos_x.data();
+    double* py = store.pos_y.data();
+    double* vx = store.vel_x.data();
+    double* vy = store.vel_y.data();
+    const double* sx = store.size_x.data();
+    const double* sy = store.size_y.data();
+    const double neg_damping = -bounds.damping;
+    for (std::size_t i = begin; i < end; ++i) {
+	const double max_x = bounds.width - sx[i];
+	const double max_y = bounds.height - sy[i];
+	const bool is_on_right_wall = px[i] >= max_x;
+	const bool is_on_left_wall = px[i] <= 0;
+	const bool is_on_wall = is_on_right_wall | is_on_left_wall;
+	const bool is_on_floor = py[i] >= max_y;
+	const bool is_on_ceiling = py[i] <= 0;
+	const bool is_bouncing = vy[i] > bounds.rest_speed;
+	const bool is_resting = is_on_floor & !is_bouncing;
+	const bool is_fast_x = std::abs(px[i] - prev_x[i]) > bounds.fast_distance;
+	const bool is_fast_y = std::abs(py[i] - prev_y[i]) > bounds.fast_distance;
+	const bool is_swept_x = is_on_wall & is_fast_x & (max_x > 0);
+	const bool is_swept_y = ((is_on_floor & is_bouncing) | is_on_ceiling)
+	    & is_fast_y & (max_y > 0);
+
+	double swept = is_on_left_wall ? px[i] * neg_damping : max_x + (px[i] - max_x) * neg_damping;
+	swept = std::min(std::max(swept, 0.0), max_x);
+	double x = is_on_left_wall ? 0.0 : px[i];
+	x = is_on_right_wall ? max_x : x;
+	px[i] = is_swept_x ? swept : x;
+	double v = is_on_wall ? vx[i] * neg_damping : vx[i];
+	vx[i] = is_resting ? v * bounds.ground_friction : v;
+
+	swept = is_on_ceiling ? py[i] * neg_damping : max_y + (py[i] - max_y) * neg_damping;
+	swept = std::min(std::max(swept, 0.0), max_y);
+	double y = is_on_floor ? max_y : py[i];
+	y = is_on_ceiling ? 0.0 : y;
+	py[i] = is_swept_y ? swept : y;
+	double floor_vy = is_bouncing ? vy[i] * neg_damping : 0.0;
+	v = is_on_floor ? floor_vy : vy[i];
+	vy[i] = is_on_ceiling ? v * neg_damping : v;
+
+	if (is_on_wall | (is_on_floor & is_bouncing) | is_on_ceiling) {
+	    bounced.push_back(i);
+	}
+    }
+}
+
+#ifdef SQUARE_SIMD_X86
+__attribute__((target("sse2")))
+inline __m128d select_sse2(__m128d mask, __m128d if_true, __m128d if_false)
+{
+    return _mm_or_pd(_mm_and_pd(mask, if_true), _mm_andnot_pd(mask, if_false));
+}
+
+__attribute__((target("sse2")))
+inline void resolve_bounds_sse2(SquareStore& store,
+				const double* prev_x,
+				const double* prev_y,
+				std::size_t begin,
+				std::size_t end,
+				const Bounds& bounds,
+				std::vector<std::size_t>& bounced)
+{
+    double* px = store.pos_x.data();
+    double* py = store.pos_y.data();
+    double* vx = store.vel_x.data();
+    double* vy = store.vel_y.data();
+    const double* sx = store.size_x.data();
+    const double* sy = store.size_y.data();
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d width = _mm_set1_pd(bounds.width);
+    const __m128d height = _mm_set1_pd(bounds.height);
+    const __m128d neg_damping = _mm_set1_pd(-bounds.damping);
+    const __m128d rest_speed = _mm_set1_pd(bounds.rest_speed);
+    const __m128d friction = _mm_set1_pd(bounds.ground_friction);
+    const __m128d fast = _mm_set1_pd(bounds.fast_distance);
+    const __m128d sign = _mm_set1_pd(-0.0);
+    std::size_t i = begin;
+    for (; i + 2 <= end; i += 2) {
+	__m128d x = _mm_loadu_pd(px + i);
+	__m128d y = _mm_loadu_pd(py + i);
+	__m128d vel_x = _mm_loadu_pd(vx + i);
+	__m128d vel_y = _mm_loadu_pd(vy + i);
+	const __m128d max_x = _mm_sub_pd(width, _mm_loadu_pd(sx + i));
+	const __m128d max_y = _mm_sub_pd(height, _mm_loadu_pd(sy + i));
+
+	const __m128d right = _mm_cmpge_pd(x, max_x);
+	const __m128d left = _mm_cmple_pd(x, zero);
+	const __m128d wall = _mm_or_pd(right, left);
+	const __m128d floor = _mm_cmpge_pd(y, max_y);
+	const __m128d ceiling = _mm_cmple_pd(y, zero);
+	const __m128d bouncing = _mm_cmpgt_pd(vel_y, rest_speed);
+	const __m128d resting = _mm_andnot_pd(bouncing, floor);
+	const __m128d fast_x = _mm_cmpgt_pd(_mm_andnot_pd(sign, _mm_sub_pd(x, _mm_loadu_pd(prev_x + i))), fast);
+	const __m128d fast_y = _mm_cmpgt_pd(_mm_andnot_pd(sign, _mm_sub_pd(y, _mm_loadu_pd(prev_y + i))), fast);
+	const __m128d swept_x = _mm_and_pd(_mm_and_pd(wall, fast_x), _mm_cmpgt_pd(max_x, zero));
+	const __m128d swept_y = _mm_and_pd(_mm_and_pd(_mm_or_pd(_mm_and_pd(floor, bouncing), ceiling), fast_y),
+					   _mm_cmpgt_pd(max_y, zero));
+
+	__m128d swept = select_sse2(left, _mm_mul_pd(x, neg_damping),
+				    _mm_add_pd(max_x, _mm_mul_pd(_mm_sub_pd(x, max_x), neg_damping)));
+	// Operands swapped from std::min/std::max, which keep the first
+	// on a tie (0.0 and -0.0) where these keep the second
+	swept = _mm_min_pd(max_x, _mm_max_pd(zero, swept));
+	x = select_sse2(left, zero, x);
+	x = select_sse2(right, max_x, x);
+	x = select_sse2(swept_x, swept, x);
+	vel_x = select_sse2(wall, _mm_mul_pd(vel_x, neg_damping), vel_x);
+	vel_x = select_sse2(resting, _mm_mul_pd(vel_x, friction), vel_x);
+
+	swept = select_sse2(ceiling, _mm_mul_pd(y, neg_damping),
+			    _mm_add_pd(max_y, _mm_mul_pd(_mm_sub_pd(y, max_y), neg_damping)));
+	swept = _mm_min_pd(max_y, _mm_max_pd(zero, swept));
+	y = select_sse2(floor, max_y, y);
+	y = select_sse2(ceiling, zero, y);
+	y = select_sse2(swept_y, swept, y);
+	const __m128d floor_vy = _mm_and_pd(bouncing, _mm_mul_pd(vel_y, neg_damping));
+	vel_y = select_sse2(floor, floor_vy, vel_y);
+	vel_y = select_sse2(ceiling, _mm_mul_pd(vel_y, neg_damping), vel_y);
+
+	_mm_storeu_pd(px + i, x);
+	_mm_storeu_pd(py + i, y);
+	_mm_storeu_pd(vx + i, vel_x);
+	_mm_storeu_pd(vy + i, vel_y);
+
+	const __m128d hit = _mm_or_pd(_mm_or_pd(wall, ceiling),
+				      _mm_and_pd(floor, bouncing));
+	for (int mask = _mm_movemask_pd(hit); mask; mask &= mask - 1) {
+	    bounced.push_back(i + __builtin_ctz(mask));
+	}
+    }
+    resolve_bounds_scalar(store, prev_x, prev_y, i, end, bounds, bounced);
+}
+
+__attribute__((target("avx2")))
+inline void resolve_bounds_avx2(SquareStore& store,
+				const double* prev_x,
+				const double* prev_y,
+				std::size_t begin,
+				std::size_t end,
+				const Bounds& bounds,
+				std::vector<std::size_t>& bounced)
+{
+    double* px = store.pos_x.data();
+    double* py = store.pos_y.data();
+    double* vx = store.vel_x.data();
+    double* vy = store.vel_y.data();
+    const double* sx = store.size_x.data();
+    const double* sy = store.size_y.data();
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d width = _mm256_set1_pd(bounds.width);
+    const __m256d height = _mm256_set1_pd(bounds.height);
+    const __m256d neg_damping = _mm256_set1_pd(-bounds.damping);
+    const __m256d rest_speed = _mm256_set1_pd(bounds.rest_speed);
+    const __m256d friction = _mm256_set1_pd(bounds.ground_friction);
+    const __m256d fast = _mm256_set1_pd(bounds.fast_distance);
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    std::size_t i = begin;
+    for (; i + 4 <= end; i += 4) {
+	__m256d x = _mm256_loadu_pd(px + i);
+	__m256d y = _mm256_loadu_pd(py + i);
+	__m256d vel_x = _mm256_loadu_pd(vx + i);
+	__m256d vel_y = _mm256_loadu_pd(vy + i);
+	const __m256d max_x = _mm256_sub_pd(width, _mm256_loadu_pd(sx + i));
+	const __m256d max_y = _mm256_sub_pd(height, _mm256_loadu_pd(sy + i));
+
+	const __m256d right = _mm256_cmp_pd(x, max_x, _CMP_GE_OQ);
+	const __m256d left = _mm256_cmp_pd(x, zero, _CMP_LE_OQ);
+	const __m256d wall = _mm256_or_pd(right, left);
+	const __m256d floor = _mm256_cmp_pd(y, max_y, _CMP_GE_OQ);
+	const __m256d ceiling = _mm256_cmp_pd(y, zero, _CMP_LE_OQ);
+	const __m256d bouncing = _mm256_cmp_pd(vel_y, rest_speed, _CMP_GT_OQ);
+	const __m256d resting = _mm256_andnot_pd(bouncing, floor);
+	const __m256d moved_x = _mm256_andnot_pd(sign, _mm256_sub_pd(x, _mm256_loadu_pd(prev_x + i)));
+	const __m256d moved_y = _mm256_andnot_pd(sign, _mm256_sub_pd(y, _mm256_loadu_pd(prev_y + i)));
+	const __m256d swept_x = _mm256_and_pd(_mm256_and_pd(wall, _mm256_cmp_pd(moved_x, fast, _CMP_GT_OQ)),
+					      _mm256_cmp_pd(max_x, zero, _CMP_GT_OQ));
+	const __m256d swept_y = _mm256_and_pd(
+	    _mm256_and_pd(_mm256_or_pd(_mm256_and_pd(floor, bouncing), ceiling),
+			  _mm256_cmp_pd(moved_y, fast, _CMP_GT_OQ)),
+	    _mm256_cmp_pd(max_y, zero, _CMP_GT_OQ));
+
+	__m256d swept = _mm256_blendv_pd(
+	    _mm256_add_pd(max_x, _mm256_mul_pd(_mm256_sub_pd(x, max_x), neg_damping)),
+	    _mm256_mul_pd(x, neg_damping), left);
+	swept = _mm256_min_pd(max_x, _mm256_max_pd(zero, swept));
+	x = _mm256_blendv_pd(x, zero, left);
+	x = _mm256_blendv_pd(x, max_x, right);
+	x = _mm256_blendv_pd(x, swept, swept_x);
+	vel_x = _mm256_blendv_pd(vel_x, _mm256_mul_pd(vel_x, neg_damping), wall);
+	vel_x = _mm256_blendv_pd(vel_x, _mm256_mul_pd(vel_x, friction), resting);
+
+	swept = _mm256_blendv_pd(
+	    _mm256_add_pd(max_y, _mm256_mul_pd(_mm256_sub_pd(y, max_y), neg_damping)),
+	    _mm256_mul_pd(y, neg_damping), ceiling);
+	swept = _mm256_min_pd(max_y, _mm256_max_pd(zero, swept));
+	y = _mm256_blendv_pd(y, max_y, floor);
+	y = _mm256_blendv_pd(y, zero, ceiling);
+	y = _mm256_blendv_pd(y, swept, swept_y);
+	const __m256d floor_vy = _mm256_and_pd(bouncing, _mm256_mul_pd(vel_y, neg_damping));
+	vel_y = _mm256_blendv_pd(vel_y, floor_vy, floor);
+	vel_y = _mm256_blendv_pd(vel_y, _mm256_mul_pd(vel_y, neg_damping), ceiling);
+
+	_mm256_storeu_pd(px + i, x);
+	_mm256_storeu_pd(py + i, y);
+	_mm256_storeu_pd(vx + i, vel_x);
+	_mm256_storeu_pd(vy + i, vel_y);
+
+	const __m256d hit = _mm256_or_pd(_mm256_or_pd(wall, ceiling),
+					 _mm256_and_pd(floor, bouncing));
+	for (int mask = _mm256_movemask_pd(hit); mask; mask &= mask - 1) {
+	    bounced.push_back(i + __builtin_ctz(mask));
+	}
+    }
+    resolve_bounds_scalar(store, prev_x, prev_y, i, end, bounds, bounced);
+}
+#endif
+
+inline void resolve_bounds(SquareStore& store,
+			   const double* prev_x,
+			   const double* prev_y,
+			   std::size_t begin,
+			   std::size_t end,
+			   const Bounds& bounds,
+			   std::vector<std::size_t>& bounced,
+			   SimdLevel max_level = SimdLevel::AVX2)
+{
+    SimdLevel level = detect_simd_level();
+    if (level > max_level) {
+	level = max_level;
+    }
+    switch (level) {
+#ifdef SQUARE_SIMD_X86
+    case SimdLevel::AVX2:
+	resolve_bounds_avx2(store, prev_x, prev_y, begin, end, bounds, bounced);
+	return;
+    case SimdLevel::SSE2:
+	resolve_bounds_sse2(store, prev_x, prev_y, begin, end, bounds, bounced);
+	return;
+#endif
+    default:
+	resolve_bounds_scalar(store, prev_x, prev_y, begin, end, bounds, bounced);
+	return;
+    }
+}
+
+#endif // SQUARE_BOUNDS_H
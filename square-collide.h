@@ -0,0 +1,106 @@
+#ifndef SQUARE_COLLIDE_H
+#define SQUARE_COLLIDE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "square-store.h"
+
+// Two squares whose boxes may overlap, a < b
+struct CollisionPair {
+    std::uint32_t a;
+    std::uint32_t b;
+};
+
+// Put pairs in (a, b) order. Broadphases that keep their structure from
+// step to step find pairs in an order that depends on its history, not
+// just on where the squares are; sorted, the same squares resolve the
+// same way however the structure got there.
+inline void sort_pairs(std::vector<CollisionPair>& pairs)
+{
+    std::sort(pairs.begin(), pairs.end(), [](CollisionPair l, CollisionPair r) {
+	return l.a != r.a ? l.a < r.a : l.b < r.b;
+    });
+}
+
+// Strict overlap: squares that only touch along an edge don't collide
+inline bool squares_overlap(const SquareStore& store, std::size_t a, std::size_t b)
+{
+    return store.pos_x[a] < store.pos_x[b] + store.size_x[b]
+	&& store.pos_x[b] < store.pos_x[a] + store.size_x[a]
+	&& store.pos_y[a] < store.pos_y[b] + store.size_y[b]
+	&& store.pos_y[b] < store.pos_y[a] + store.size_y[a];
+}
+
+// Narrowphase and response for candidate pairs from a broadphase. Each
+// overlapping pair is pushed apart along the axis of least penetration,
+// heavier (bigger) squares moving less, and if they are approaching
+// they exchange an impulse along that axis. Pairs are handled in order,
+// so the result only depends on the pair order.
+inline void resolve_pairs(SquareStore& store,
+			  const std::vector<CollisionPair>& pairs,
+			  double restitution)
+{
+    double* px = store.pos_x.data();
+    double* py = store.pos_y.data();
+    double* vx = store.vel_x.data();
+    double* vy = store.vel_y.data();
+    const double* sx = store.size_x.data();
+    const double* sy = store.size_y.data();
+    for (const CollisionPair& pair : pairs) {
+	const std::size_t a = pair.a;
+	const std::size_t b = pair.b;
+	if (!squares_overlap(store, a, b)) {
+	    continue;
+	}
+	// Penetration depth on each axis and which way b sits from a
+	const double dx = (px[b] + sx[b] * 0.5) - (px[a] + sx[a] * 0.5);
+	const double dy = (py[b] + sy[b] * 0.5) - (py[a] + sy[a] * 0.5);
+	const double overlap_x = (sx[a] + sx[b]) * 0.5 - std::abs(dx);
+	const double overlap_y = (sy[a] + sy[b]) * 0.5 - std::abs(dy);
+
+	const double inv_mass_a = 1.0 / (sx[a] * sy[a]);
+	const double inv_mass_b = 1.0 / (sx[b] * sy[b]);
+	const double inv_mass = inv_mass_a + inv_mass_b;
+
+	double* pos_a;
+	double* pos_b;
+	double* vel_a;
+	double* vel_b;
+	double overlap;
+	double normal;
+	if (overlap_x < overlap_y) {
+	    pos_a = &px[a];
+	    pos_b = &px[b];
+	    vel_a = &vx[a];
+	    vel_b = &vx[b];
+	    overlap = overlap_x;
+	    // Coincident centers: push the lower index left/up
+	    normal = dx < 0 ? -1.0 : 1.0;
+	} else {
+	    pos_a = &py[a];
+	    pos_b = &py[b];
+	    vel_a = &vy[a];
+	    vel_b = &vy[b];
+	    overlap = overlap_y;
+	    normal = dy < 0 ? -1.0 : 1.0;
+	}
+
+	// Separate
+	*pos_a -= normal * overlap * (inv_mass_a / inv_mass);
+	*pos_b += normal * overlap * (inv_mass_b / inv_mass);
+
+	// Bounce if approaching
+	const double closing = (*vel_b - *vel_a) * normal;
+	if (closing < 0) {
+	    const double impulse = -(1.0 + restitution) * closing / inv_mass;
+	    *vel_a -= normal * impulse * inv_mass_a;
+	    *vel_b += normal * impulse * inv_mass_b;
+	}
+    }
+}
+
+#endif // SQUARE_COLLIDE_H
@@ -0,0 +1,179 @@
+#ifndef SQUARE_SIMD_H
+#define SQUARE_SIMD_H
+
+#include <cstddef>
+
+#include "square-store.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SQUARE_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+// Instruction sets the integration kernel can run on, widest last
+enum class SimdLevel {
+    Scalar,
+    SSE2,
+    AVX2,
+};
+
+// Strict keeps every operation in the same order and rounding as the
+// per-square member calls so results are bit-identical to the scalar
+// path. Fast lets the AVX2 kernel fuse the air resistance multiply into
+// the position add, which skips one rounding step.
+//
+// Note: strict only holds if the compiler is not contracting the scalar
+// path into FMAs on its own; build with -ffp-contract=off when
+// validating on a -march that has FMA.
+enum class IntegrateMode {
+    Strict,
+    Fast,
+};
+
+inline const char* simd_level_name(SimdLevel level)
+{
+    switch (level) {
+    case SimdLevel::AVX2:
+	return "avx2";
+    case SimdLevel::SSE2:
+	return "sse2";
+    case SimdLevel::Scalar:
+	break;
+    }
+    return "scalar";
+}
+
+inline SimdLevel detect_simd_level(void)
+{
+#ifdef SQUARE_SIMD_X86
+    static const SimdLevel level = [] {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+	    return SimdLevel::AVX2;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+	    return SimdLevel::SSE2;
+	}
+	return SimdLevel::Scalar;
+    }();
+    return level;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+// Gravity, air resistance and position update for squares [begin, end).
+// Same arithmetic as Square::applyGravity, applyAirResistance and
+// updatePosition, in the same order.
+inline void integrate_scalar(SquareStore& store,
+			     std::size_t begin,
+			     std::size_t end,
+			     double gravity,
+			     double air_resistance)
+{
+    double* px = store.pos_x.data();
+    double* py = store.pos_y.data();
+    double* vx = store.vel_x.data();
+    double* vy = store.vel_y.data();
+    for (std::size_t i = begin; i < end; ++i) {
+	vy[i] += gravity;
+	vx[i] *= air_resistance;
+	px[i] += vx[i];
+	py[i] += vy[i];
+    }
+}
+
+#ifdef SQUARE_SIMD_X86
+__attribute__((target("sse2")))
+inline void integrate_sse2(SquareStore& store,
+			   std::size_t begin,
+			   std::size_t end,
+			   double gravity,
+			   double air_resistance)
+{
+    double* px = store.pos_x.data();
+    double* py = store.pos_y.data();
+    double* vx = store.vel_x.data();
+    double* vy = store.vel_y.data();
+    const __m128d g = _mm_set1_pd(gravity);
+    const __m128d ar = _mm_set1_pd(air_resistance);
+    std::size_t i = begin;
+    for (; i + 2 <= end; i += 2) {
+	__m128d vel_y = _mm_add_pd(_mm_loadu_pd(vy + i), g);
+	__m128d vel_x = _mm_mul_pd(_mm_loadu_pd(vx + i), ar);
+	_mm_storeu_pd(vy + i, vel_y);
+	_mm_storeu_pd(vx + i, vel_x);
+	_mm_storeu_pd(px + i, _mm_add_pd(_mm_loadu_pd(px + i), vel_x));
+	_mm_storeu_pd(py + i, _mm_add_pd(_mm_loadu_pd(py + i), vel_y));
+    }
+    integrate_scalar(store, i, end, gravity, air_resistance);
+}
+
+__attribute__((target("avx2,fma")))
+inline void integrate_avx2(SquareStore& store,
+			   std::size_t begin,
+			   std::size_t end,
+			   double gravity,
+			   double air_resistance,
+			   IntegrateMode mode)
+{
+    double* px = store.pos_x.data();
+    double* py = store.pos_y.data();
+    double* vx = store.vel_x.data();
+    double* vy = store.vel_y.data();
+    const __m256d g = _mm256_set1_pd(gravity);
+    const __m256d ar = _mm256_set1_pd(air_resistance);
+    std::size_t i = begin;
+    if (mode == IntegrateMode::Strict) {
+	for (; i + 4 <= end; i += 4) {
+	    __m256d vel_y = _mm256_add_pd(_mm256_loadu_pd(vy + i), g);
+	    __m256d vel_x = _mm256_mul_pd(_mm256_loadu_pd(vx + i), ar);
+	    _mm256_storeu_pd(vy + i, vel_y);
+	    _mm256_storeu_pd(vx + i, vel_x);
+	    _mm256_storeu_pd(px + i, _mm256_add_pd(_mm256_loadu_pd(px + i), vel_x));
+	    _mm256_storeu_pd(py + i, _mm256_add_pd(_mm256_loadu_pd(py + i), vel_y));
+	}
+    } else {
+	for (; i + 4 <= end; i += 4) {
+	    __m256d vel_y = _mm256_add_pd(_mm256_loadu_pd(vy + i), g);
+	    __m256d old_vx = _mm256_loadu_pd(vx + i);
+	    _mm256_storeu_pd(vy + i, vel_y);
+	    _mm256_storeu_pd(vx + i, _mm256_mul_pd(old_vx, ar));
+	    _mm256_storeu_pd(px + i, _mm256_fmadd_pd(old_vx, ar, _mm256_loadu_pd(px + i)));
+	    _mm256_storeu_pd(py + i, _mm256_add_pd(_mm256_loadu_pd(py + i), vel_y));
+	}
+    }
+    integrate_scalar(store, i, end, gravity, air_resistance);
+}
+#endif
+
+// Integrate squares [begin, end) on the widest kernel allowed by both
+// the CPU and max_level.
+inline void integrate_squares(SquareStore& store,
+			      std::size_t begin,
+			      std::size_t end,
+			      double gravity,
+			      double air_resistance,
+			      IntegrateMode mode = IntegrateMode::Strict,
+			      SimdLevel max_level = SimdLevel::AVX2)
+{
+    SimdLevel level = detect_simd_level();
+    if (level > max_level) {
+	level = max_level;
+    }
+    switch (level) {
+#ifdef SQUARE_SIMD_X86
+    case SimdLevel::AVX2:
+	integrate_avx2(store, begin, end, gravity, air_resistance, mode);
+	return;
+    case SimdLevel::SSE2:
+	integrate_sse2(store, begin, end, gravity, air_resistance);
+	return;
+#endif
+    default:
+	integrate_scalar(store, begin, end, gravity, air_resistance);
+	return;
+    }
+}
+
+#endif // SQUARE_SIMD_H
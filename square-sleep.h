@@ -0,0 +1,311 @@
+#ifndef SQUARE_SLEEP_H
+#define SQUARE_SLEEP_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "square-collide.h"
+#include "square-store.h"
+
+// Puts squares that have been at rest for a while to sleep so the step
+// can skip them. Rest is judged by how far a square actually moved in
+// the step, not by its velocity: squares in a pile keep gaining speed
+// from gravity that the collision pass then undoes by pushing them back
+// out, so their velocity never settles even when they stay put.
+//
+// Squares touching each other form an island, and an island only
+// sleeps once every square in it has been slow for frames_to_sleep
+// steps, so a stack doesn't go to sleep with one square still settling.
+// A sleeping island wakes as a whole when an awake square runs into it,
+// or when wake() is called for user input.
+//
+// Awake squares are handed out as sorted index runs, so the cost of the
+// integrate and bounds passes follows the number of awake squares.
+class SleepSystem
+{
+public:
+    struct Run {
+	std::uint32_t begin;
+	std::uint32_t end;
+    };
+
+    bool enabled {true};
+    // Squares moving less than this per step count as resting; stacked
+    // squares bob by about half a pixel
+    double sleep_speed {1.0};
+    int frames_to_sleep {30};
+
+private:
+    static constexpr std::uint32_t kNone {0xffffffffu};
+
+    std::vector<std::uint8_t> m_asleep;
+    std::vector<std::uint16_t> m_rest_frames;
+    // Where awake squares were at the end of the last step
+    std::vector<double> m_last_x;
+    std::vector<double> m_last_y;
+    // Sleeping islands are circular lists through this
+    std::vector<std::uint32_t> m_island_next;
+    // Union-find over awake squares, rebuilt every update
+    std::vector<std::uint32_t> m_parent;
+    std::vector<std::uint16_t> m_island_rest;
+    std::vector<std::uint32_t> m_island_head;
+    std::vector<Run> m_runs;
+    std::size_t m_awake {0};
+    bool m_runs_dirty {true};
+    std::size_t m_bodies {0};
+    std::uint32_t m_generation {0};
+
+    std::uint32_t find(std::uint32_t i) {
+	while (m_parent[i] != i) {
+	    m_parent[i] = m_parent[m_parent[i]];
+	    i = m_parent[i];
+	}
+	return i;
+    }
+
+    void unite(std::uint32_t a, std::uint32_t b) {
+	a = find(a);
+	b = find(b);
+	if (a != b) {
+	    m_parent[std::max(a, b)] = std::min(a, b);
+	}
+    }
+
+    void rebuild_runs() {
+	m_runs.clear();
+	m_awake = 0;
+	const std::uint32_t n = static_cast<std::uint32_t>(m_bodies);
+	for (std::uint32_t i = 0; i < n;) {
+	    while (i < n && m_asleep[i]) {
+		++i;
+	    }
+	    const std::uint32_t begin = i;
+	    while (i < n && !m_asleep[i]) {
+		++i;
+	    }
+	    if (begin < i) {
+		m_runs.push_back({begin, i});
+		m_awake += i - begin;
+	    }
+	}
+	m_runs_dirty = false;
+    }
+
+    // Match the store, waking everything if it was reinitialized
+    void sync(const SquareStore& store) {
+	if (store.size() == m_bodies && store.generation == m_generation) {
+	    return;
+	}
+	m_bodies = store.size();
+	m_generation = store.generation;
+	m_asleep.assign(m_bodies, 0);
+	m_rest_frames.assign(m_bodies, 0);
+	m_last_x.assign(store.pos_x.begin(), store.pos_x.end());
+	m_last_y.assign(store.pos_y.begin(), store.pos_y.end());
+	m_island_next.assign(m_bodies, kNone);
+	m_parent.resize(m_bodies);
+	m_island_rest.resize(m_bodies);
+	m_island_head.resize(m_bodies);
+	m_runs_dirty = true;
+    }
+
+public:
+    bool asleep(std::size_t i) const { return i < m_asleep.size() && m_asleep[i]; }
+    std::size_t awakeCount() const { return enabled ? m_awake : m_bodies; }
+
+    // Per-square state carried from one step to the next, for saving a
+    // snapshot. Only matches the store once a step has run since it last
+    // changed; before that the next step starts everything awake anyway.
+    bool tracks(const SquareStore& store) const {
+	return store.size() == m_bodies && store.generation == m_generation;
+    }
+    const std::vector<std::uint8_t>& asleepFlags() const { return m_asleep; }
+    const std::vector<std::uint16_t>& restFrames() const { return m_rest_frames; }
+    const std::vector<double>& lastX() const { return m_last_x; }
+    const std::vector<double>& lastY() const { return m_last_y; }
+    const std::vector<std::uint32_t>& islandNext() const { return m_island_next; }
+
+    // Whether saved state for n squares can be restored: sleeping
+    // squares, and only those, are linked into islands, and every link
+    // is to one of the n squares. Anything else would send wake() off
+    // the end of the arrays.
+    static bool consistent(std::size_t n,
+			   const std::uint8_t* asleep,
+			   const std::uint32_t* island_next) {
+	if (n >= kNone) {
+	    return false;
+	}
+	for (std::size_t i = 0; i < n; ++i) {
+	    const bool linked = island_next[i] != kNone;
+	    if (asleep[i] > 1 || linked != (asleep[i] == 1) || (linked && island_next[i] >= n)) {
+		return false;
+	    }
+	}
+	return true;
+    }
+
+    // Pick up state saved from the above for the squares now in store.
+    // The state has to be consistent().
+    void restore(const SquareStore& store,
+		 const std::uint8_t* asleep,
+		 const std::uint16_t* rest_frames,
+		 const double* last_x,
+		 const double* last_y,
+		 const std::uint32_t* island_next) {
+	m_bodies = store.size();
+	m_generation = store.generation;
+	m_asleep.assign(asleep, asleep + m_bodies);
+	m_rest_frames.assign(rest_frames, rest_frames + m_bodies);
+	m_last_x.assign(last_x, last_x + m_bodies);
+	m_last_y.assign(last_y, last_y + m_bodies);
+	m_island_next.assign(island_next, island_next + m_bodies);
+	m_parent.resize(m_bodies);
+	m_island_rest.resize(m_bodies);
+	m_island_head.resize(m_bodies);
+	m_runs_dirty = true;
+    }
+
+    // Call fn(begin, end) for every run of awake squares inside
+    // [begin, end)
+    template <typename Fn>
+    void for_awake(std::size_t begin, std::size_t end, Fn&& fn) const {
+	if (!enabled) {
+	    fn(begin, end);
+	    return;
+	}
+	auto run = std::lower_bound(m_runs.begin(), m_runs.end(), begin,
+				    [](const Run& r, std::size_t i) { return r.end <= i; });
+	for (; run != m_runs.end() && run->begin < end; ++run) {
+	    fn(std::max<std::size_t>(run->begin, begin), std::min<std::size_t>(run->end, end));
+	}
+    }
+
+    // Wake the island square i sleeps in
+    void wake(std::size_t i) {
+	if (!asleep(i)) {
+	    return;
+	}
+	std::uint32_t j = static_cast<std::uint32_t>(i);
+	do {
+	    m_asleep[j] = 0;
+	    m_rest_frames[j] = 0;
+	    std::uint32_t next = m_island_next[j];
+	    m_island_next[j] = kNone;
+	    j = next;
+	} while (j != kNone && j != i);
+	m_runs_dirty = true;
+    }
+
+    void wake_all() {
+	std::fill(m_asleep.begin(), m_asleep.end(), 0);
+	std::fill(m_rest_frames.begin(), m_rest_frames.end(), 0);
+	std::fill(m_island_next.begin(), m_island_next.end(), kNone);
+	m_runs_dirty = true;
+    }
+
+    // Call before a step: brings the awake runs up to date
+    void begin_step(const SquareStore& store) {
+	sync(store);
+	if (m_runs_dirty) {
+	    rebuild_runs();
+	}
+    }
+
+    // Drop pairs of two sleeping squares (nothing to resolve) and wake
+    // sleeping islands an awake square is touching
+    void filter_pairs(std::vector<CollisionPair>& pairs) {
+	if (!enabled) {
+	    return;
+	}
+	std::size_t kept = 0;
+	for (const CollisionPair& pair : pairs) {
+	    const bool a_asleep = asleep(pair.a);
+	    const bool b_asleep = asleep(pair.b);
+	    if (a_asleep && b_asleep) {
+		continue;
+	    }
+	    if (a_asleep) {
+		wake(pair.a);
+	    } else if (b_asleep) {
+		wake(pair.b);
+	    }
+	    pairs[kept++] = pair;
+	}
+	pairs.resize(kept);
+    }
+
+    // Call after a step with the pairs that were resolved in it. Counts
+    // how long awake squares have been resting and puts islands that
+    // have all been resting long enough to sleep.
+    void end_step(SquareStore& store, const std::vector<CollisionPair>& pairs) {
+	if (!enabled) {
+	    return;
+	}
+	sync(store);
+	if (m_runs_dirty) {
+	    rebuild_runs();
+	}
+	const double* px = store.pos_x.data();
+	const double* py = store.pos_y.data();
+	double* vx = store.vel_x.data();
+	double* vy = store.vel_y.data();
+	const double slow = sleep_speed * sleep_speed;
+
+	for (const Run& run : m_runs) {
+	    for (std::uint32_t i = run.begin; i < run.end; ++i) {
+		const double dx = px[i] - m_last_x[i];
+		const double dy = py[i] - m_last_y[i];
+		m_last_x[i] = px[i];
+		m_last_y[i] = py[i];
+		const bool resting = dx * dx + dy * dy < slow;
+		m_rest_frames[i] = resting
+		    ? static_cast<std::uint16_t>(std::min(m_rest_frames[i] + 1, 0xffff))
+		    : 0;
+		m_parent[i] = i;
+		m_island_rest[i] = 0xffff;
+		m_island_head[i] = kNone;
+	    }
+	}
+	for (const CollisionPair& pair : pairs) {
+	    if (!m_asleep[pair.a] && !m_asleep[pair.b]) {
+		unite(pair.a, pair.b);
+	    }
+	}
+	// An island is as restless as its least rested square
+	for (const Run& run : m_runs) {
+	    for (std::uint32_t i = run.begin; i < run.end; ++i) {
+		std::uint32_t root = find(i);
+		m_island_rest[root] = std::min(m_island_rest[root], m_rest_frames[i]);
+	    }
+	}
+	bool changed = false;
+	for (const Run& run : m_runs) {
+	    for (std::uint32_t i = run.begin; i < run.end; ++i) {
+		const std::uint32_t root = find(i);
+		if (m_island_rest[root] < frames_to_sleep) {
+		    continue;
+		}
+		// Link i into its island's circular list
+		std::uint32_t& head = m_island_head[root];
+		if (head == kNone) {
+		    head = i;
+		    m_island_next[i] = i;
+		} else {
+		    m_island_next[i] = m_island_next[head];
+		    m_island_next[head] = i;
+		}
+		m_asleep[i] = 1;
+		vx[i] = 0.0;
+		vy[i] = 0.0;
+		changed = true;
+	    }
+	}
+	if (changed) {
+	    m_runs_dirty = true;
+	}
+    }
+};
+
+#endif // SQUARE_SLEEP_H
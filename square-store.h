@@ -0,0 +1,239 @@
+#ifndef SQUARE_STORE_H
+#define SQUARE_STORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+#include "SDL2/SDL.h"
+
+struct Vec2 {
+    double x {0.0};
+    double y {0.0};
+
+    Vec2() = default;
+    Vec2(double x_val, double y_val)
+	: x {x_val}
+	, y {y_val} {}
+    Vec2 operator+(const Vec2& other) const {
+	return Vec2(x + other.x, y + other.y);
+    }
+    // TODO: Add more methods
+};
+
+struct Color {
+    // Default to white
+    Uint8 red {0xff};
+    Uint8 green {0xff};
+    Uint8 blue {0xff};
+    Uint8 alpha {0xff};
+    Color() = default;
+    Color(Uint8 r, Uint8 g, Uint8 b, Uint8 a)
+	: red {r}
+	, green {g}
+	, blue {b}
+	, alpha(a) {}
+    Color(Uint8 r, Uint8 g, Uint8 b)
+	: Color(r, g, b, 0xff) {}
+};
+
+// Cache line sized allocations so every array in the store starts on
+// its own line and vector loads never straddle the start of an array.
+constexpr std::size_t gCacheLineSize {64};
+
+template <typename T, std::size_t Alignment = gCacheLineSize>
+struct AlignedAllocator {
+    using value_type = T;
+    template <typename U>
+    struct rebind { using other = AlignedAllocator<U, Alignment>; };
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(std::size_t n) {
+	return static_cast<T*>(::operator new(n * sizeof(T),
+					      std::align_val_t {Alignment}));
+    }
+    void deallocate(T* p, std::size_t) {
+	::operator delete(p, std::align_val_t {Alignment});
+    }
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+class Square;
+
+// Structure-of-arrays storage for squares. Each component lives in its
+// own contiguous array so a pass over one field (e.g. integrating
+// velocities) streams through memory instead of chasing pointers.
+struct SquareStore {
+    AlignedVector<double> pos_x;
+    AlignedVector<double> pos_y;
+    AlignedVector<double> vel_x;
+    AlignedVector<double> vel_y;
+    AlignedVector<double> size_x;
+    AlignedVector<double> size_y;
+    AlignedVector<Color> color;
+    // Bumped by clear() so handles from before a reinit can tell they
+    // are stale
+    std::uint32_t generation {0};
+
+    class iterator;
+
+    std::size_t size() const { return pos_x.size(); }
+    bool empty() const { return pos_x.empty(); }
+
+    void reserve(std::size_t n) {
+	pos_x.reserve(n);
+	pos_y.reserve(n);
+	vel_x.reserve(n);
+	vel_y.reserve(n);
+	size_x.reserve(n);
+	size_y.reserve(n);
+	color.reserve(n);
+    }
+
+    // Keeps capacity so a reinit does not go back to the heap
+    void clear() {
+	++generation;
+	pos_x.clear();
+	pos_y.clear();
+	vel_x.clear();
+	vel_y.clear();
+	size_x.clear();
+	size_y.clear();
+	color.clear();
+    }
+
+    Square add(Vec2 size, Vec2 pos, Vec2 v, Color c = {});
+    Square operator[](std::size_t i);
+
+    iterator begin();
+    iterator end();
+};
+
+// Lightweight handle to one square inside a SquareStore. Copy it
+// freely; it stays valid across store growth since it holds an index
+// rather than pointers into the arrays. Clearing the store invalidates
+// it, which valid() can check.
+class Square
+{
+private:
+    SquareStore* m_store {nullptr};
+    std::size_t m_index {0};
+    std::uint32_t m_generation {0};
+
+public:
+    Square() = default;
+    Square(SquareStore* store, std::size_t index)
+	: m_store {store}
+	, m_index {index}
+	, m_generation {store->generation} {}
+    std::size_t index() const { return m_index; }
+    bool valid() const {
+	return m_store
+	    && m_store->generation == m_generation
+	    && m_index < m_store->size();
+    }
+    Vec2 size() const {
+	return {m_store->size_x[m_index], m_store->size_y[m_index]};
+    }
+    void setSize(Vec2 size) {
+	m_store->size_x[m_index] = size.x;
+	m_store->size_y[m_index] = size.y;
+    }
+    Vec2 position() const {
+	return {m_store->pos_x[m_index], m_store->pos_y[m_index]};
+    }
+    void setPos(Vec2 pos) {
+	m_store->pos_x[m_index] = pos.x;
+	m_store->pos_y[m_index] = pos.y;
+    }
+    void setPosX(double x) { m_store->pos_x[m_index] = x; }
+    void setPosY(double y) { m_store->pos_y[m_index] = y; }
+    Vec2 velocity() const {
+	return {m_store->vel_x[m_index], m_store->vel_y[m_index]};
+    }
+    void setVelocity(Vec2 velocity) {
+	m_store->vel_x[m_index] = velocity.x;
+	m_store->vel_y[m_index] = velocity.y;
+    }
+    Color color() const { return m_store->color[m_index]; }
+    void setColor(Color color) { m_store->color[m_index] = color; }
+
+    void applyGravity(double gravity)
+    {
+	m_store->vel_y[m_index] += gravity;
+    }
+
+    void applyAirResistance(double air_resistance)
+    {
+	m_store->vel_x[m_index] *= air_resistance;
+    }
+
+    void dampX(double damping) {
+	m_store->vel_x[m_index] *= -damping;
+    }
+
+    void dampY(double damping) {
+	m_store->vel_y[m_index] *= -damping;
+    }
+
+    void updatePosition()
+    {
+	m_store->pos_x[m_index] += m_store->vel_x[m_index];
+	m_store->pos_y[m_index] += m_store->vel_y[m_index];
+    }
+};
+
+class SquareStore::iterator
+{
+private:
+    SquareStore* m_store {nullptr};
+    std::size_t m_index {0};
+
+public:
+    iterator(SquareStore* store, std::size_t index)
+	: m_store {store}
+	, m_index {index} {}
+    Square operator*() const { return Square(m_store, m_index); }
+    iterator& operator++() { ++m_index; return *this; }
+    bool operator==(const iterator& other) const { return m_index == other.m_index; }
+    bool operator!=(const iterator& other) const { return m_index != other.m_index; }
+};
+
+inline Square SquareStore::add(Vec2 size, Vec2 pos, Vec2 v, Color c)
+{
+    pos_x.push_back(pos.x);
+    pos_y.push_back(pos.y);
+    vel_x.push_back(v.x);
+    vel_y.push_back(v.y);
+    size_x.push_back(size.x);
+    size_y.push_back(size.y);
+    color.push_back(c);
+    return Square(this, pos_x.size() - 1);
+}
+
+inline Square SquareStore::operator[](std::size_t i)
+{
+    return Square(this, i);
+}
+
+inline SquareStore::iterator SquareStore::begin()
+{
+    return iterator(this, 0);
+}
+
+inline SquareStore::iterator SquareStore::end()
+{
+    return iterator(this, size());
+}
+
+#endif // SQUARE_STORE_H
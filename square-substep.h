@@ -0,0 +1,224 @@
+#ifndef SQUARE_SUBSTEP_H
+#define SQUARE_SUBSTEP_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "square-collide.h"
+#include "square-store.h"
+
+// Adaptive sub-stepping for fast squares. A square that would move more
+// than max_fraction of its own size in a step can pass straight through
+// a smaller square between two broadphase runs, so it is split into
+// enough sub-steps to keep each move under that fraction, up to
+// max_substeps. Everything else still takes one step through the SIMD
+// kernels.
+//
+// The step goes:
+//  1. classify() each job chunk before integrating it, noting the fast
+//     squares and where they started.
+//  2. sweep_boxes() after integrating, which stretches each fast
+//     square's box over the whole move so the broadphase reports every
+//     square it could run into on the way.
+//  3. restore() after the broadphase, putting fast squares back where
+//     they started, then take_pairs() to move the pairs involving a
+//     fast square out of the normal pair list.
+//  4. step() to redo the fast squares in sub-steps, resolving their
+//     pairs after each one.
+//
+// Fast squares are bucketed by sub-step count and each bucket runs its
+// sub-steps as one batch, so the loop over them is tight and the slow
+// majority never sees any of it.
+class SubStepper
+{
+public:
+    // Largest move per (sub-)step, relative to the square's smaller side
+    double max_fraction {0.5};
+    int max_substeps {8};
+
+private:
+    struct Body {
+	std::uint32_t index;
+	std::uint32_t substeps;
+	// State before the step, and the real size while the box is swept
+	double pos_x;
+	double pos_y;
+	double vel_x;
+	double vel_y;
+	double size_x;
+	double size_y;
+    };
+
+    // Fast squares found by each job chunk
+    std::vector<std::vector<Body>> m_found;
+    // All fast squares, by sub-step count
+    std::vector<Body> m_bodies;
+    // m_bodies[m_bucket_start[k] .. m_bucket_start[k + 1]] take k sub-steps
+    std::vector<std::size_t> m_bucket_start;
+    // Pairs to resolve after every sub-step, by sub-step count
+    std::vector<std::vector<CollisionPair>> m_bucket_pairs;
+    // Sub-step count per square, 0 for squares taking one step
+    std::vector<std::uint8_t> m_substeps;
+    std::size_t m_squares {0};
+    std::uint32_t m_generation {0};
+
+public:
+    std::size_t fastCount() const { return m_bodies.size(); }
+
+    // Call at the start of a step split into chunks job chunks
+    void begin(const SquareStore& store, std::size_t chunks) {
+	if (store.size() != m_squares || store.generation != m_generation) {
+	    m_squares = store.size();
+	    m_generation = store.generation;
+	    m_substeps.assign(m_squares, 0);
+	} else {
+	    for (const Body& body : m_bodies) {
+		m_substeps[body.index] = 0;
+	    }
+	}
+	m_bodies.clear();
+	if (m_found.size() < chunks) {
+	    m_found.resize(chunks);
+	}
+	for (std::vector<Body>& found : m_found) {
+	    found.clear();
+	}
+	const std::size_t buckets = static_cast<std::size_t>(max_substeps) + 1;
+	m_bucket_start.assign(buckets + 1, 0);
+	if (m_bucket_pairs.size() < buckets) {
+	    m_bucket_pairs.resize(buckets);
+	}
+	for (std::vector<CollisionPair>& pairs : m_bucket_pairs) {
+	    pairs.clear();
+	}
+    }
+
+    // Note the fast squares in [begin, end), before they are integrated.
+    // Safe to call from job chunk c.
+    void classify(const SquareStore& store, std::size_t c,
+		  std::size_t begin, std::size_t end, double gravity) {
+	const double* vx = store.vel_x.data();
+	const double* vy = store.vel_y.data();
+	const double* sx = store.size_x.data();
+	const double* sy = store.size_y.data();
+	for (std::size_t i = begin; i < end; ++i) {
+	    const double move = std::max(std::abs(vx[i]), std::abs(vy[i] + gravity));
+	    const double limit = max_fraction * std::min(sx[i], sy[i]);
+	    if (move <= limit) {
+		continue;
+	    }
+	    const double needed = limit > 0.0 ? std::ceil(move / limit) : max_substeps;
+	    const int substeps = static_cast<int>(std::min<double>(needed, max_substeps));
+	    if (substeps < 2) {
+		continue;
+	    }
+	    m_found[c].push_back({static_cast<std::uint32_t>(i),
+				  static_cast<std::uint32_t>(substeps),
+				  store.pos_x[i], store.pos_y[i], vx[i], vy[i],
+				  sx[i], sy[i]});
+	}
+    }
+
+    // Bucket the fast squares and grow each one's box to cover where it
+    // was and where one step took it
+    void sweep_boxes(SquareStore& store) {
+	for (const std::vector<Body>& found : m_found) {
+	    for (const Body& body : found) {
+		++m_bucket_start[body.substeps + 1];
+	    }
+	}
+	const std::size_t buckets = m_bucket_start.size() - 1;
+	for (std::size_t k = 0; k < buckets; ++k) {
+	    m_bucket_start[k + 1] += m_bucket_start[k];
+	}
+	m_bodies.resize(m_bucket_start[buckets]);
+	for (const std::vector<Body>& found : m_found) {
+	    for (const Body& body : found) {
+		m_bodies[m_bucket_start[body.substeps]++] = body;
+		m_substeps[body.index] = static_cast<std::uint8_t>(body.substeps);
+	    }
+	}
+	for (std::size_t k = buckets; k > 0; --k) {
+	    m_bucket_start[k] = m_bucket_start[k - 1];
+	}
+	m_bucket_start[0] = 0;
+
+	for (const Body& body : m_bodies) {
+	    const std::size_t i = body.index;
+	    const double x = std::min(body.pos_x, store.pos_x[i]);
+	    const double y = std::min(body.pos_y, store.pos_y[i]);
+	    store.size_x[i] = std::max(body.pos_x, store.pos_x[i]) + body.size_x - x;
+	    store.size_y[i] = std::max(body.pos_y, store.pos_y[i]) + body.size_y - y;
+	    store.pos_x[i] = x;
+	    store.pos_y[i] = y;
+	}
+    }
+
+    // Put fast squares back to where they were before the step
+    void restore(SquareStore& store) const {
+	for (const Body& body : m_bodies) {
+	    const std::size_t i = body.index;
+	    store.pos_x[i] = body.pos_x;
+	    store.pos_y[i] = body.pos_y;
+	    store.vel_x[i] = body.vel_x;
+	    store.vel_y[i] = body.vel_y;
+	    store.size_x[i] = body.size_x;
+	    store.size_y[i] = body.size_y;
+	}
+    }
+
+    // Move pairs with a fast square out of pairs, keeping the order of
+    // the rest. A pair of two fast squares goes with the one taking more
+    // sub-steps.
+    void take_pairs(std::vector<CollisionPair>& pairs) {
+	if (m_bodies.empty()) {
+	    return;
+	}
+	std::size_t kept = 0;
+	for (const CollisionPair& pair : pairs) {
+	    const std::uint8_t substeps = std::max(m_substeps[pair.a], m_substeps[pair.b]);
+	    if (substeps != 0) {
+		m_bucket_pairs[substeps].push_back(pair);
+	    } else {
+		pairs[kept++] = pair;
+	    }
+	}
+	pairs.resize(kept);
+    }
+
+    // Advance the fast squares through their sub-steps, using the same
+    // integration as integrate_squares with the step divided up
+    void step(SquareStore& store, double gravity, double air_resistance,
+	      double restitution) {
+	double* px = store.pos_x.data();
+	double* py = store.pos_y.data();
+	double* vx = store.vel_x.data();
+	double* vy = store.vel_y.data();
+	const std::size_t buckets = m_bucket_start.size() - 1;
+	for (std::size_t k = 2; k < buckets; ++k) {
+	    const std::size_t begin = m_bucket_start[k];
+	    const std::size_t end = m_bucket_start[k + 1];
+	    if (begin == end) {
+		continue;
+	    }
+	    const double dt = 1.0 / static_cast<double>(k);
+	    const double g = gravity * dt;
+	    const double ar = std::pow(air_resistance, dt);
+	    for (std::size_t s = 0; s < k; ++s) {
+		for (std::size_t b = begin; b < end; ++b) {
+		    const std::size_t i = m_bodies[b].index;
+		    vy[i] += g;
+		    vx[i] *= ar;
+		    px[i] += vx[i] * dt;
+		    py[i] += vy[i] * dt;
+		}
+		resolve_pairs(store, m_bucket_pairs[k], restitution);
+	    }
+	}
+    }
+};
+
+#endif // SQUARE_SUBSTEP_H
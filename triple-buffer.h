@@ -0,0 +1,65 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <atomic>
+
+#include "square-store.h"
+
+// Lock-free triple buffer for handing whole states from one writer
+// thread to one reader thread. The writer fills its back buffer and
+// publishes it, the reader picks up the newest published buffer as its
+// front buffer, and the third buffer sits in the middle between them.
+// Neither side ever waits: the writer can publish as often as it likes
+// (the reader just skips states it was too slow for) and the reader
+// keeps drawing its front buffer until a newer one arrives.
+//
+// Buffers are reused round robin, so a T that keeps its capacity (like
+// an AlignedVector) stops allocating once all three have grown.
+template <typename T>
+class TripleBuffer
+{
+private:
+    // Set in m_middle while the middle buffer holds a state the reader
+    // hasn't picked up yet
+    static constexpr unsigned kFresh {4};
+
+    T m_buffers[3];
+    // The indices live on their own cache lines so the two threads don't
+    // bounce each other's line
+    alignas(gCacheLineSize) std::atomic<unsigned> m_middle {1};
+    alignas(gCacheLineSize) unsigned m_back {0};
+    alignas(gCacheLineSize) unsigned m_front {2};
+
+public:
+    // Only before either thread starts using it: call fn on all three
+    // buffers, e.g. to size them up front
+    template <typename Fn>
+    void for_each(Fn&& fn) {
+	for (T& buffer : m_buffers) {
+	    fn(buffer);
+	}
+    }
+
+    // Writer only: the buffer to fill next. It holds an old state.
+    T& back() { return m_buffers[m_back]; }
+
+    // Writer only: hand the back buffer to the reader
+    void publish() {
+	m_back = m_middle.exchange(m_back | kFresh, std::memory_order_acq_rel) & 3;
+    }
+
+    // Reader only: switch the front buffer to the newest published
+    // state, if there is one. Returns whether it changed.
+    bool update() {
+	if (!(m_middle.load(std::memory_order_relaxed) & kFresh)) {
+	    return false;
+	}
+	m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & 3;
+	return true;
+    }
+
+    // Reader only: the newest state picked up by update()
+    const T& front() const { return m_buffers[m_front]; }
+};
+
+#endif // TRIPLE_BUFFER_H
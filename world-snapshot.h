@@ -0,0 +1,316 @@
+#ifndef WORLD_SNAPSHOT_H
+#define WORLD_SNAPSHOT_H
+
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "fast-random.h"
+#include "square-sleep.h"
+#include "square-store.h"
+
+// Binary snapshot of the simulation: every square, the sleep state and
+// the random generator a step draws from, so a restored run carries on
+// step for step exactly as the saved one would have.
+//
+// The file is the in-memory layout written out as is: a fixed header,
+// then one section per SoA array (pos_x, pos_y, ... as in SquareStore),
+// each starting on a cache line like the arrays themselves. Saving is a
+// single writev() pass over the store's own arrays; loading maps the
+// file and copies each section straight into its array, so nothing is
+// parsed per square and the cost is one memcpy of the file, plus one
+// check of the sleep links.
+//
+// Files are only read back on a machine with the same byte order and
+// type sizes; the header records both and anything else is refused.
+// The version changes whenever the layout does.
+
+// Everything besides the per-square arrays that the next step depends
+// on. The program's own enums are stored as their values.
+struct SnapshotScalars {
+    double gravity {0.0};
+    double damping {0.0};
+    double air_resistance {0.0};
+    double restitution {0.0};
+    double rest_speed {0.0};
+    double ground_friction {0.0};
+    // Velocities are in pixels per step of this long
+    double step_seconds {0.0};
+    // Physics steps run so far
+    std::uint64_t step {0};
+    std::uint32_t broadphase {0};
+    std::uint32_t integrate_mode {0};
+    std::uint32_t sleep_enabled {0};
+    std::uint32_t reserved {0};
+    // The simulation thread's generators
+    std::uint32_t random[RandomGenerator::kStateWords] {};
+    std::uint32_t random_lanes[RandomLanes::kStateWords] {};
+};
+
+enum class SnapshotSection : std::uint32_t {
+    PosX,
+    PosY,
+    VelX,
+    VelY,
+    SizeX,
+    SizeY,
+    Color,
+    // SleepSystem's, absent if no step has run since the squares changed
+    Asleep,
+    RestFrames,
+    LastX,
+    LastY,
+    IslandNext,
+    Count,
+};
+
+constexpr std::size_t kSnapshotSections {static_cast<std::size_t>(SnapshotSection::Count)};
+constexpr std::uint32_t kSnapshotVersion {3};
+constexpr char kSnapshotMagic[8] {'G', 'S', 'Q', 'S', 'N', 'A', 'P', '\n'};
+// Reads back as 0x04030201 on a machine of the other byte order
+constexpr std::uint32_t kSnapshotByteOrder {0x01020304u};
+
+struct SnapshotHeader {
+    char magic[8] {};
+    std::uint32_t version {0};
+    std::uint32_t byte_order {0};
+    std::uint32_t header_bytes {0};
+    std::uint32_t section_count {0};
+    std::uint64_t square_count {0};
+    std::uint64_t file_bytes {0};
+    SnapshotScalars scalars;
+    // Where each section starts, 0 if it is absent, and the size of one
+    // element, which must match this build's
+    std::uint64_t section_offset[kSnapshotSections] {};
+    std::uint32_t element_bytes[kSnapshotSections] {};
+};
+
+// Size of one element of each section in this build
+constexpr std::uint32_t kSnapshotElementBytes[kSnapshotSections] {
+    sizeof(double), sizeof(double), sizeof(double), sizeof(double),
+    sizeof(double), sizeof(double), sizeof(Color),
+    sizeof(std::uint8_t), sizeof(std::uint16_t), sizeof(double), sizeof(double),
+    sizeof(std::uint32_t),
+};
+
+namespace snapshot_detail {
+
+inline std::size_t align_up(std::size_t n)
+{
+    return (n + gCacheLineSize - 1) / gCacheLineSize * gCacheLineSize;
+}
+
+// Write every iovec, picking up after short writes
+inline bool write_all(int fd, iovec* iov, std::size_t count)
+{
+    while (count > 0) {
+	const std::size_t batch = count < IOV_MAX ? count : IOV_MAX;
+	const ssize_t n = ::writev(fd, iov, static_cast<int>(batch));
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    return false;
+	}
+	std::size_t left = static_cast<std::size_t>(n);
+	while (count > 0 && left >= iov->iov_len) {
+	    left -= iov->iov_len;
+	    ++iov;
+	    --count;
+	}
+	if (left > 0) {
+	    iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+	    iov->iov_len -= left;
+	}
+    }
+    return true;
+}
+
+} // namespace snapshot_detail
+
+// Write store, sleep and scalars to path. Goes through a temporary file
+// renamed into place, so a failed save leaves an older snapshot intact.
+inline bool save_snapshot(const std::string& path,
+			  const SnapshotScalars& scalars,
+			  const SquareStore& store,
+			  const SleepSystem& sleep)
+{
+    using snapshot_detail::align_up;
+
+    // Sections in order, nullptr for absent ones
+    const bool has_sleep = sleep.tracks(store);
+    const void* const arrays[kSnapshotSections] {
+	store.pos_x.data(), store.pos_y.data(),
+	store.vel_x.data(), store.vel_y.data(),
+	store.size_x.data(), store.size_y.data(),
+	store.color.data(),
+	has_sleep ? sleep.asleepFlags().data() : nullptr,
+	has_sleep ? sleep.restFrames().data() : nullptr,
+	has_sleep ? sleep.lastX().data() : nullptr,
+	has_sleep ? sleep.lastY().data() : nullptr,
+	has_sleep ? sleep.islandNext().data() : nullptr,
+    };
+    const std::size_t first_sleep = static_cast<std::size_t>(SnapshotSection::Asleep);
+
+    SnapshotHeader header;
+    std::memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+    header.version = kSnapshotVersion;
+    header.byte_order = kSnapshotByteOrder;
+    header.header_bytes = sizeof(SnapshotHeader);
+    header.section_count = kSnapshotSections;
+    header.square_count = store.size();
+    header.scalars = scalars;
+
+    // Header, then each present section after enough zeros to start it
+    // on a cache line
+    static const char zeros[gCacheLineSize] {};
+    iovec iov[1 + 2 * kSnapshotSections];
+    std::size_t count = 0;
+    iov[count++] = {&header, sizeof(header)};
+    std::size_t offset = sizeof(header);
+    for (std::size_t s = 0; s < kSnapshotSections; ++s) {
+	if (s >= first_sleep && !has_sleep) {
+	    continue;
+	}
+	const std::size_t start = align_up(offset);
+	if (start > offset) {
+	    iov[count++] = {const_cast<char*>(zeros), start - offset};
+	}
+	const std::size_t bytes = store.size() * kSnapshotElementBytes[s];
+	if (bytes > 0) {
+	    iov[count++] = {const_cast<void*>(arrays[s]), bytes};
+	}
+	header.section_offset[s] = start;
+	header.element_bytes[s] = kSnapshotElementBytes[s];
+	offset = start + bytes;
+    }
+    header.file_bytes = offset;
+
+    const std::string temporary = path + ".tmp";
+    const int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+	return false;
+    }
+    bool ok = snapshot_detail::write_all(fd, iov, count);
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || std::rename(temporary.c_str(), path.c_str()) != 0) {
+	::unlink(temporary.c_str());
+	return false;
+    }
+    return true;
+}
+
+// Replace store, sleep and scalars with the snapshot at path. Nothing is
+// touched unless the file is a complete snapshot this build can read
+// and accept(scalars) agrees, which is where the caller checks the
+// values only it knows the meaning of. The store's generation is bumped
+// as by clear(), so anything built over the old squares (broadphases,
+// sub-stepping) starts over.
+template <typename Accept>
+inline bool load_snapshot(const std::string& path,
+			  SnapshotScalars& scalars,
+			  SquareStore& store,
+			  SleepSystem& sleep,
+			  Accept&& accept)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+	return false;
+    }
+    struct stat info {};
+    if (::fstat(fd, &info) != 0 || static_cast<std::size_t>(info.st_size) < sizeof(SnapshotHeader)) {
+	::close(fd);
+	return false;
+    }
+    const std::size_t file_bytes = static_cast<std::size_t>(info.st_size);
+    // Populated up front: every page is about to be read once, in order
+    void* mapping = ::mmap(nullptr, file_bytes, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+	return false;
+    }
+    ::madvise(mapping, file_bytes, MADV_SEQUENTIAL);
+    const char* base = static_cast<const char*>(mapping);
+    SnapshotHeader header;
+    std::memcpy(&header, base, sizeof(header));
+
+    const std::size_t n = header.square_count;
+    bool ok = std::memcmp(header.magic, kSnapshotMagic, sizeof(header.magic)) == 0
+	&& header.version == kSnapshotVersion
+	&& header.byte_order == kSnapshotByteOrder
+	&& header.header_bytes == sizeof(SnapshotHeader)
+	&& header.section_count == kSnapshotSections
+	&& header.file_bytes == file_bytes
+	&& accept(static_cast<const SnapshotScalars&>(header.scalars));
+    const void* sections[kSnapshotSections] {};
+    for (std::size_t s = 0; ok && s < kSnapshotSections; ++s) {
+	const std::uint64_t offset = header.section_offset[s];
+	if (offset == 0) {
+	    continue;
+	}
+	ok = header.element_bytes[s] == kSnapshotElementBytes[s]
+	    && offset % gCacheLineSize == 0
+	    && offset <= file_bytes
+	    && n <= (file_bytes - offset) / kSnapshotElementBytes[s];
+	sections[s] = base + offset;
+    }
+    // The squares themselves have to be there; sleep state may not be
+    const bool has_sleep = ok && sections[static_cast<std::size_t>(SnapshotSection::Asleep)] != nullptr;
+    for (std::size_t s = 0; ok && s < kSnapshotSections; ++s) {
+	if (sections[s] == nullptr) {
+	    ok = s >= static_cast<std::size_t>(SnapshotSection::Asleep) && !has_sleep;
+	}
+    }
+    // The one pass over the squares before anything is copied: sleep
+    // state is followed as links, so a damaged file mustn't get in
+    ok = ok && (!has_sleep
+		|| SleepSystem::consistent(
+		    n,
+		    static_cast<const std::uint8_t*>(sections[static_cast<std::size_t>(SnapshotSection::Asleep)]),
+		    static_cast<const std::uint32_t*>(sections[static_cast<std::size_t>(SnapshotSection::IslandNext)])));
+    if (!ok) {
+	::munmap(mapping, file_bytes);
+	return false;
+    }
+
+    auto section = [&sections](SnapshotSection s) {
+	return sections[static_cast<std::size_t>(s)];
+    };
+    auto copy = [n, &section](auto& array, SnapshotSection s) {
+	using T = typename std::remove_reference_t<decltype(array)>::value_type;
+	const T* data = static_cast<const T*>(section(s));
+	array.assign(data, data + n);
+    };
+    store.clear();
+    copy(store.pos_x, SnapshotSection::PosX);
+    copy(store.pos_y, SnapshotSection::PosY);
+    copy(store.vel_x, SnapshotSection::VelX);
+    copy(store.vel_y, SnapshotSection::VelY);
+    copy(store.size_x, SnapshotSection::SizeX);
+    copy(store.size_y, SnapshotSection::SizeY);
+    copy(store.color, SnapshotSection::Color);
+    if (has_sleep) {
+	sleep.restore(store,
+		      static_cast<const std::uint8_t*>(section(SnapshotSection::Asleep)),
+		      static_cast<const std::uint16_t*>(section(SnapshotSection::RestFrames)),
+		      static_cast<const double*>(section(SnapshotSection::LastX)),
+		      static_cast<const double*>(section(SnapshotSection::LastY)),
+		      static_cast<const std::uint32_t*>(section(SnapshotSection::IslandNext)));
+    }
+    scalars = header.scalars;
+    ::munmap(mapping, file_bytes);
+    return true;
+}
+
+#endif // WORLD_SNAPSHOT_H